@@ -0,0 +1,138 @@
+// Sorting large graphs of aggregates with sortAggregates().
+//
+// "chain" is a single chain of aggregates, deeper than a recursive sort
+// could go. "dag" gives every aggregate a few dependencies among the
+// aggregates before it. "cycles" is the dag with every 100th aggregate in a
+// cycle with the next one. Each order is checked, so this fails rather
+// than reports a time if an aggregate comes before one it depends on or
+// the wrong aggregates end up in a cycle.
+//
+// Usage: bench-aggregate-graph [aggregates]
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "constituents.hh"
+
+namespace {
+
+constexpr size_t DAG_DEPENDENCIES = 4;
+constexpr size_t CYCLE_SPACING = 100;
+
+auto aggregateName(size_t i) -> std::string {
+    return "aggregate-" + std::to_string(i);
+}
+
+auto makeAggregates(size_t count) -> std::vector<AggregateJob> {
+    std::vector<AggregateJob> aggregates;
+    aggregates.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        aggregates.push_back({.name = aggregateName(i)});
+    }
+    return aggregates;
+}
+
+auto makeChain(size_t count) -> std::vector<AggregateJob> {
+    auto aggregates = makeAggregates(count);
+    for (size_t i = 0; i + 1 < count; i++) {
+        aggregates[i].dependencies.insert(aggregateName(i + 1));
+    }
+    return aggregates;
+}
+
+auto makeDag(size_t count) -> std::vector<AggregateJob> {
+    auto aggregates = makeAggregates(count);
+    std::mt19937 random(count);
+    for (size_t i = 1; i < count; i++) {
+        std::uniform_int_distribution<size_t> before(0, i - 1);
+        for (size_t j = 0; j < DAG_DEPENDENCIES; j++) {
+            aggregates[i].dependencies.insert(aggregateName(before(random)));
+        }
+    }
+    return aggregates;
+}
+
+auto makeCycles(size_t count) -> std::vector<AggregateJob> {
+    auto aggregates = makeDag(count);
+    for (size_t i = 0; i + 1 < count; i += CYCLE_SPACING) {
+        aggregates[i].dependencies.insert(aggregateName(i + 1));
+        aggregates[i + 1].dependencies.insert(aggregateName(i));
+    }
+    return aggregates;
+}
+
+[[noreturn]] void fail(const char *label, const std::string &message) {
+    std::cerr << label << ": " << message << "\n";
+    std::exit(1);
+}
+
+void check(const char *label, const std::vector<AggregateJob> &aggregates,
+           const SortedAggregates &result, size_t expectedCycles) {
+    if (result.cycles.size() != expectedCycles) {
+        fail(label, "expected " + std::to_string(expectedCycles) +
+                        " cycles, got " +
+                        std::to_string(result.cycles.size()));
+    }
+
+    std::unordered_set<std::string> inCycle;
+    for (const auto &cycle : result.cycles) {
+        if (cycle.aggregates.size() != 2) {
+            fail(label, "unexpected " + cycle.message());
+        }
+        inCycle.insert(cycle.aggregates.begin(), cycle.aggregates.end());
+    }
+
+    std::unordered_map<std::string, size_t> position;
+    for (size_t i = 0; i < result.sorted.size(); i++) {
+        position.emplace(result.sorted[i].name, i);
+    }
+    if (position.size() + inCycle.size() != aggregates.size()) {
+        fail(label, "aggregates were lost or duplicated");
+    }
+
+    for (const auto &aggregate : result.sorted) {
+        for (const auto &dependency : aggregate.dependencies) {
+            if (inCycle.contains(dependency)) {
+                continue;
+            }
+            auto it = position.find(dependency);
+            if (it == position.end() ||
+                it->second > position.at(aggregate.name)) {
+                fail(label, aggregate.name + " comes before " + dependency);
+            }
+        }
+    }
+}
+
+void measure(const char *label, const std::vector<AggregateJob> &aggregates,
+             size_t expectedCycles) {
+    auto copy = aggregates;
+    const auto start = std::chrono::steady_clock::now();
+    auto result = sortAggregates(std::move(copy));
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    check(label, aggregates, result, expectedCycles);
+    std::cout << label << ": " << elapsed.count() << " ms ("
+              << result.sorted.size() << " sorted, " << result.cycles.size()
+              << " cycles)\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t count =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(100000);
+
+    measure("chain", makeChain(count), 0);
+    measure("dag", makeDag(count), 0);
+    measure("cycles", makeCycles(count),
+            (count - 1 + CYCLE_SPACING - 1) / CYCLE_SPACING);
+}
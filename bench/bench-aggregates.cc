@@ -0,0 +1,138 @@
+// Time to rewrite the aggregates of --constituents, on one thread and on
+// one thread per core.
+//
+// Every aggregate has a few plain jobs as constituents, each of which is a
+// constituent of about SHARING aggregates. All but the first WAVE_WIDTH
+// aggregates also have the aggregate WAVE_WIDTH before them as a
+// constituent, so they are rewritten in waves of WAVE_WIDTH. Derivations
+// are written to a temporary chroot store.
+//
+// Usage: bench-aggregates [aggregates]
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <nix/main/shared.hh>
+#include <nix/store/derivations.hh>
+#include <nix/store/local-fs-store.hh>
+#include <nix/store/store-open.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/ref.hh>
+#include <nlohmann/json.hpp>
+
+#include "constituents.hh"
+
+namespace {
+
+constexpr size_t CONSTITUENTS = 8;
+constexpr size_t WAVE_WIDTH = 256;
+constexpr size_t SHARING = 4;
+
+/* An input-addressed derivation without inputs. Returns the derivation
+   and output paths. */
+auto writeDrv(nix::LocalFSStore &store, const std::string &name)
+    -> std::pair<std::string, std::string> {
+    nix::Derivation drv;
+    drv.name = name;
+    drv.platform = "x86_64-linux";
+    drv.builder = "/bin/sh";
+    drv.env["builder"] = drv.builder;
+    drv.env["name"] = name;
+    drv.env["out"] = "";
+    drv.env["system"] = drv.platform;
+    drv.outputs.insert_or_assign("out", nix::DerivationOutput::Deferred{});
+
+    auto hashModulo = nix::hashDerivationModulo(store, drv, true);
+    auto outPath =
+        store.makeOutputPath("out", hashModulo.hashes.at("out"), name);
+    drv.env["out"] = store.printStorePath(outPath);
+    drv.outputs.insert_or_assign(
+        "out", nix::DerivationOutput::InputAddressed{.path = outPath});
+
+    return {store.printStorePath(nix::writeDerivation(store, drv)),
+            store.printStorePath(outPath)};
+}
+
+/* Derivation names start with `prefix`, so that runs do not share
+   derivations or their cached hashes */
+auto makeJobs(nix::LocalFSStore &store, const std::string &prefix,
+              size_t aggregates) -> std::map<std::string, JobRecord> {
+    std::map<std::string, JobRecord> jobs;
+    const size_t plainJobs = aggregates * CONSTITUENTS / SHARING + 1;
+    for (size_t i = 0; i < plainJobs; i++) {
+        const auto name = "job-" + std::to_string(i);
+        jobs.emplace(name, JobRecord{
+                               .drvPath = writeDrv(store, prefix + name).first,
+                               .error = std::nullopt,
+                               .aggregate = std::nullopt,
+                           });
+    }
+
+    for (size_t i = 0; i < aggregates; i++) {
+        const auto name = "aggregate-" + std::to_string(i);
+        auto named = nlohmann::json::array();
+        for (size_t c = 0; c < CONSTITUENTS; c++) {
+            named.push_back("job-" +
+                            std::to_string((i * CONSTITUENTS + c) % plainJobs));
+        }
+        if (i >= WAVE_WIDTH) {
+            named.push_back("aggregate-" + std::to_string(i - WAVE_WIDTH));
+        }
+
+        auto [drvPath, outPath] = writeDrv(store, prefix + name);
+        nlohmann::json job = {
+            {"attr", name},
+            {"drvPath", drvPath},
+            {"namedConstituents", named},
+            {"outputs", {{"out", outPath}}},
+        };
+        jobs.emplace(name, JobRecord{
+                               .drvPath = drvPath,
+                               .error = std::nullopt,
+                               .aggregate = std::move(job),
+                           });
+    }
+    return jobs;
+}
+
+void measure(const char *label, const nix::ref<nix::LocalFSStore> &store,
+             size_t aggregates, size_t threads) {
+    auto jobs = makeJobs(*store, label, aggregates);
+    const auto aggregateJobs = resolveNamedConstituents(jobs).sorted;
+
+    DerivationCache derivations;
+    const auto start = std::chrono::steady_clock::now();
+    rewriteAggregates(jobs, aggregateJobs, store, derivations, "", threads);
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const auto stats = derivations.stats();
+    std::cerr << label << ": " << elapsed.count() << " ms for " << aggregates
+              << " aggregates (" << stats.hits << " of "
+              << stats.hits + stats.misses << " constituents cached)\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t aggregates =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(4096);
+
+    nix::initNix();
+    const auto root = nix::createTempDir();
+    const nix::AutoDelete deleteRoot(root);
+    auto store = nix::ref<nix::LocalFSStore>(
+        nix::openStore("local?root=" + std::string(root))
+            .dynamic_pointer_cast<nix::LocalFSStore>());
+
+    // The rewritten aggregates are printed to stdout
+    std::cout.rdbuf(nullptr);
+
+    measure("serial", store, aggregates, 1);
+    measure("parallel", store, aggregates, 0);
+}
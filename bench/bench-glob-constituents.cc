@@ -0,0 +1,96 @@
+// Cost of expanding the glob constituents of aggregates on a large job
+// table.
+//
+// "scan" matches every pattern against every job with fnmatch(), as
+// resolveNamedConstituents() used to. "resolve" is
+// resolveNamedConstituents() itself, which only matches the jobs starting
+// with the part of the pattern before the first wildcard.
+//
+// Usage: bench-glob-constituents [jobs]
+
+#include <fnmatch.h>
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "constituents.hh"
+
+namespace {
+
+constexpr size_t SETS = 64;
+
+auto makeJobs(size_t count) -> std::map<std::string, JobRecord> {
+    std::map<std::string, JobRecord> jobs;
+    for (size_t i = 0; i < count; i++) {
+        jobs.emplace("set" + std::to_string(i % SETS) + ".package-" +
+                         std::to_string(i / SETS),
+                     JobRecord{});
+    }
+
+    // One aggregate per set, and a few with wildcards earlier on
+    std::vector<std::string> patterns = {"set1?.package-1*", "set*.package-7",
+                                         "set[0-3].*"};
+    for (size_t set = 0; set < SETS; set++) {
+        patterns.push_back("set" + std::to_string(set) + ".*");
+    }
+    for (size_t i = 0; i < patterns.size(); i++) {
+        jobs.emplace("aggregate-" + std::to_string(i),
+                     JobRecord{
+                         .drvPath = "",
+                         .error = std::nullopt,
+                         .aggregate = nlohmann::json{
+                             {"namedConstituents", {patterns[i]}},
+                             {"globConstituents", true},
+                         },
+                     });
+    }
+    return jobs;
+}
+
+void report(const char *label, std::chrono::steady_clock::time_point start,
+            size_t matches) {
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << label << ": " << elapsed.count() << " ms (" << matches
+              << " matches)\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t count =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(200000);
+    const auto jobs = makeJobs(count);
+
+    auto start = std::chrono::steady_clock::now();
+    size_t matches = 0;
+    for (const auto &[aggregateName, aggregate] : jobs) {
+        if (!aggregate.aggregate.has_value()) {
+            continue;
+        }
+        for (const std::string pattern :
+             aggregate.aggregate->at("namedConstituents")) {
+            for (const auto &[name, job] : jobs) {
+                if (name != aggregateName &&
+                    fnmatch(pattern.c_str(), name.c_str(), 0) == 0) {
+                    matches++;
+                }
+            }
+        }
+    }
+    report("scan", start, matches);
+
+    start = std::chrono::steady_clock::now();
+    matches = 0;
+    for (const auto &aggregate : resolveNamedConstituents(jobs).sorted) {
+        matches += aggregate.dependencies.size();
+    }
+    report("resolve", start, matches);
+}
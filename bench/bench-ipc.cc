@@ -0,0 +1,130 @@
+// Messages per second over a pipe for the collector <-> worker transport.
+//
+// "lines" is the previous newline-delimited protocol: the writer appends '\n'
+// to a copy of every reply and the collector runs getline() and parses each
+// reply as JSON. "frames" is the length-prefixed transport from
+// buffered-io.hh, where the collector only decodes the frame header.
+//
+// Usage: bench-ipc [messages]
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+
+#include <nix/util/file-descriptor.hh>
+#include <nlohmann/json.hpp>
+
+#include "buffered-io.hh"
+
+namespace {
+
+auto makeReply() -> std::string {
+    nlohmann::json reply = {
+        {"attr", "python3Packages.requests"},
+        {"attrPath", {"python3Packages", "requests"}},
+        {"drvPath", "/nix/store/0n8s4bmnyz7p7p0vx2ca7pvcw2ybmiyq-python3.12-"
+                    "requests-2.32.3.drv"},
+        {"name", "python3.12-requests-2.32.3"},
+        {"outputs",
+         {{"dist", "/nix/store/1j2b8rhgh7bcm1hw6kxcbkb7z9kq7hyh-python3.12-"
+                   "requests-2.32.3-dist"},
+          {"out", "/nix/store/9q5a0fg5z6c3ah3k4yrw0rkj1w8b6g7s-python3.12-"
+                  "requests-2.32.3"}}},
+        {"system", "x86_64-linux"},
+        {"meta",
+         {{"description", "HTTP library for Python"},
+          {"homepage", "http://docs.python-requests.org/en/latest/"},
+          {"license", {{"spdxId", "Apache-2.0"}, {"free", true}}},
+          {"platforms", {"x86_64-linux", "aarch64-linux", "x86_64-darwin",
+                         "aarch64-darwin"}}}},
+    };
+    return reply.dump();
+}
+
+auto writeAll(int fd, std::string_view data) -> bool {
+    while (!data.empty()) {
+        const ssize_t res = write(fd, data.data(), data.size());
+        if (res <= 0) {
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(res));
+    }
+    return true;
+}
+
+template <typename Writer, typename Reader>
+auto measure(const char *label, size_t messages, Writer writer, Reader reader)
+    -> void {
+    std::array<int, 2> fds{};
+    if (pipe(fds.data()) != 0) {
+        std::perror("pipe");
+        std::exit(1);
+    }
+    const auto start = std::chrono::steady_clock::now();
+    std::thread producer([&]() -> void {
+        const nix::AutoCloseFD out(fds[1]);
+        for (size_t i = 0; i < messages; i++) {
+            writer(out.get());
+        }
+    });
+    const size_t received = reader(fds[0]);
+    producer.join();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << label << ": " << received << " messages in "
+              << elapsed.count() << "s, "
+              << static_cast<double>(received) / elapsed.count()
+              << " messages/s\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t messages =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(200000);
+    const auto reply = makeReply();
+
+    measure(
+        "lines", messages,
+        [&](int fd) -> void {
+            std::string line = reply;
+            line += "\n";
+            (void)writeAll(fd, line);
+        },
+        [](int fd) -> size_t {
+            std::unique_ptr<FILE, decltype(&std::fclose)> stream(
+                fdopen(fd, "r"), &std::fclose);
+            char *buf = nullptr;
+            size_t len = 0;
+            size_t count = 0;
+            while (getline(&buf, &len, stream.get()) != -1) {
+                auto json = nlohmann::json::parse(buf);
+                count += json.contains("attrs") ? 0 : 1;
+            }
+            std::free(buf); // NOLINT(cppcoreguidelines-no-malloc)
+            return count;
+        });
+
+    measure(
+        "frames", messages,
+        [&](int fd) -> void {
+            (void)tryWriteFrame(fd, {.type = FrameType::Job}, reply);
+        },
+        [](int fd) -> size_t {
+            enlargePipeBuffer(fd);
+            FrameReader reader(fd);
+            size_t count = 0;
+            while (auto frame = reader.readFrame()) {
+                count += frame->header.type == FrameType::Job ? 1 : 0;
+            }
+            return count;
+        });
+}
@@ -0,0 +1,121 @@
+// Collector CPU per job for the fields it needs with --constituents, when
+// the worker replies include --meta.
+//
+// "parse" is the previous approach of parsing the whole reply with
+// nlohmann::json. "scan" locates the top-level fields with JsonFields and
+// only parses "attr", "drvPath" and "error".
+//
+// Usage: bench-json-fields [jobs]
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+#include "json-fields.hh"
+
+namespace {
+
+constexpr size_t MAINTAINERS = 8;
+
+auto makeReply() -> std::string {
+    auto maintainers = nlohmann::json::array();
+    for (size_t i = 0; i < MAINTAINERS; i++) {
+        maintainers.push_back({
+            {"email", "maintainer" + std::to_string(i) + "@example.org"},
+            {"github", "maintainer" + std::to_string(i)},
+            {"githubId", 1000 + i},
+            {"name", "Maintainer " + std::to_string(i)},
+        });
+    }
+    nlohmann::json reply = {
+        {"attr", "python3Packages.requests"},
+        {"attrPath", {"python3Packages", "requests"}},
+        {"drvPath", "/nix/store/0n8s4bmnyz7p7p0vx2ca7pvcw2ybmiyq-python3.12-"
+                    "requests-2.32.3.drv"},
+        {"name", "python3.12-requests-2.32.3"},
+        {"outputs",
+         {{"dist", "/nix/store/1j2b8rhgh7bcm1hw6kxcbkb7z9kq7hyh-python3.12-"
+                   "requests-2.32.3-dist"},
+          {"out", "/nix/store/9q5a0fg5z6c3ah3k4yrw0rkj1w8b6g7s-python3.12-"
+                  "requests-2.32.3"}}},
+        {"system", "x86_64-linux"},
+        {"meta",
+         {{"available", true},
+          {"broken", false},
+          {"changelog", "https://github.com/psf/requests/blob/v2.32.3/"
+                        "HISTORY.md"},
+          {"description", "HTTP library for Python"},
+          {"homepage", "http://docs.python-requests.org/en/latest/"},
+          {"insecure", false},
+          {"license",
+           {{"deprecated", false},
+            {"free", true},
+            {"fullName", "Apache License 2.0"},
+            {"redistributable", true},
+            {"shortName", "asl20"},
+            {"spdxId", "Apache-2.0"},
+            {"url", "https://spdx.org/licenses/Apache-2.0.html"}}},
+          {"maintainers", maintainers},
+          {"name", "python3.12-requests-2.32.3"},
+          {"outputsToInstall", {"out"}},
+          {"platforms",
+           {"aarch64-darwin", "aarch64-linux", "armv5tel-linux",
+            "armv6l-linux", "armv7l-linux", "i686-linux", "loongarch64-linux",
+            "mips64el-linux", "powerpc64le-linux", "riscv64-linux",
+            "s390x-linux", "x86_64-darwin", "x86_64-linux"}},
+          {"position", "/nix/store/zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz-source/"
+                       "pkgs/development/python-modules/requests/"
+                       "default.nix:91"},
+          {"unfree", false},
+          {"unsupported", false}}},
+    };
+    return reply.dump();
+}
+
+template <typename Extract>
+void measure(const char *label, size_t jobs, const std::string &reply,
+             Extract extract) {
+    size_t checksum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < jobs; i++) {
+        checksum += extract(reply).size();
+    }
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << label << ": " << elapsed.count() / static_cast<double>(jobs)
+              << " ns/job (" << checksum << ")\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t jobs =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(200000);
+    const auto reply = makeReply();
+    std::cout << "reply: " << reply.size() << " bytes\n";
+
+    measure("parse", jobs, reply, [](const std::string &reply) -> auto {
+        auto job = nlohmann::json::parse(reply);
+        nlohmann::json result = nlohmann::json::object();
+        for (const auto *key : {"attr", "drvPath", "error"}) {
+            if (job.contains(key)) {
+                result[key] = std::move(job[key]);
+            }
+        }
+        return result;
+    });
+
+    measure("scan", jobs, reply, [](const std::string &reply) -> auto {
+        const JsonFields fields(reply);
+        nlohmann::json result = nlohmann::json::object();
+        for (const auto *key : {"attr", "drvPath", "error"}) {
+            if (auto value = fields.get(key)) {
+                result[key] = std::move(*value);
+            }
+        }
+        return result;
+    });
+}
@@ -0,0 +1,131 @@
+// Cost of converting meta attribute sets to JSON, as done for --meta.
+//
+// "print+parse" is the previous approach of printing every meta attribute
+// with printValueAsJSON() into a stringstream and parsing it back with
+// nlohmann::json. "direct" builds the nlohmann::json tree from the value
+// with the other printValueAsJSON() overload. The values are forced
+// beforehand, so only the conversion is measured.
+//
+// Usage: bench-value-to-json [packages]
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include <nix/cmd/common-eval-args.hh>
+#include <nix/expr/attr-set.hh>
+#include <nix/expr/eval-gc.hh>
+#include <nix/expr/eval.hh>
+#include <nix/expr/search-path.hh>
+#include <nix/expr/value-to-json.hh>
+#include <nix/expr/value.hh>
+#include <nix/expr/value/context.hh>
+#include <nix/main/shared.hh>
+#include <nix/store/store-open.hh>
+#include <nix/util/pos-idx.hh>
+#include <nlohmann/json.hpp>
+
+namespace {
+
+/* Roughly the meta of a nixpkgs package */
+constexpr std::string_view PACKAGES = R"nix(
+  n:
+  builtins.listToAttrs (builtins.genList (i: {
+    name = "package-${toString i}";
+    value = {
+      available = true;
+      broken = false;
+      description = "Package number ${toString i}";
+      longDescription = ''
+        A package that does many things. It has a long description spanning
+        several lines, as quite a few packages in nixpkgs do, to explain what
+        it is good for and how it compares to the alternatives.
+      '';
+      homepage = "https://example.org/package-${toString i}";
+      changelog = "https://example.org/package-${toString i}/CHANGELOG.md";
+      license = {
+        deprecated = false;
+        free = true;
+        fullName = "MIT License";
+        redistributable = true;
+        shortName = "mit";
+        spdxId = "MIT";
+        url = "https://spdx.org/licenses/MIT.html";
+      };
+      maintainers = builtins.genList (m: {
+        email = "maintainer${toString m}@example.org";
+        github = "maintainer${toString m}";
+        githubId = 1000 + m;
+        name = "Maintainer ${toString m}";
+      }) 4;
+      mainProgram = "package-${toString i}";
+      name = "package-${toString i}-1.0";
+      outputsToInstall = [ "out" ];
+      platforms = [
+        "aarch64-darwin" "aarch64-linux" "armv6l-linux" "armv7l-linux"
+        "i686-linux" "loongarch64-linux" "powerpc64le-linux"
+        "riscv64-linux" "s390x-linux" "x86_64-darwin" "x86_64-linux"
+      ];
+      position = "/nix/store/source/pkgs/by-name/package.nix:${toString i}";
+      unfree = false;
+      unsupported = false;
+    };
+  }) n)
+)nix";
+
+template <typename Convert>
+void measure(const char *label, nix::EvalState &state, nix::Value &packages,
+             Convert convert) {
+    size_t checksum = 0;
+    size_t count = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto &package : *packages.attrs()) {
+        nlohmann::json meta;
+        for (const auto &attr : *package.value->attrs()) {
+            meta[std::string(state.symbols[attr.name])] = convert(*attr.value);
+        }
+        checksum += meta.size();
+        count++;
+    }
+    const std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << label << ": " << elapsed.count() / static_cast<double>(count)
+              << " us/package (" << checksum << ")\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+    const size_t packages =
+        argc > 1 ? std::stoul(argv[1]) : static_cast<size_t>(20000);
+
+    nix::initNix();
+    nix::initGC();
+    auto state = nix::make_ref<nix::EvalState>(
+        nix::LookupPath{}, nix::openStore("dummy://"), nix::fetchSettings,
+        nix::evalSettings);
+
+    auto *expr = state->parseExprFromString(
+        std::string(PACKAGES) + " " + std::to_string(packages),
+        state->rootPath("."));
+    nix::Value value;
+    state->eval(expr, value);
+    state->forceValueDeep(value);
+
+    measure("print+parse", *state, value,
+            [&](nix::Value &meta) -> nlohmann::json {
+                nix::NixStringContext context;
+                std::stringstream stream;
+                nix::printValueAsJSON(*state, true, meta, nix::noPos, stream,
+                                      context);
+                return nlohmann::json::parse(stream.str());
+            });
+
+    measure("direct", *state, value, [&](nix::Value &meta) -> nlohmann::json {
+        nix::NixStringContext context;
+        return nix::printValueAsJSON(*state, true, meta, nix::noPos,
+                                     context);
+    });
+}
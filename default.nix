@@ -15,9 +15,11 @@ stdenv.mkDerivation {
     fileset = lib.fileset.unions [
       ./.clang-tidy
       ./meson.build
+      ./meson_options.txt
       ./src/meson.build
       (lib.fileset.fileFilter (file: file.hasExt "cc") ./src)
       (lib.fileset.fileFilter (file: file.hasExt "hh") ./src)
+      ./tests/unit
     ];
     root = ./.;
   };
@@ -42,6 +44,9 @@ stdenv.mkDerivation {
     ]
     ++ lib.optional stdenv.cc.isClang (lib.hiPrio pkgs.llvmPackages.clang-tools);
 
+  # The unit tests in tests/unit
+  doCheck = true;
+
   passthru = {
     inherit nixComponents;
   };
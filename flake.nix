@@ -126,6 +126,7 @@
                   exit 1
                 fi
               '';
+              doCheck = false;
               installPhase = ''
                 touch $out
               '';
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+/* An array that only grows. Elements never move, so other threads can read
+   them without a lock while one thread appends: chunk k holds
+   FIRST_CHUNK << k elements, and is allocated once the ones before it are
+   full.
+
+   Appending needs external synchronization. An element may be read by any
+   thread that learned its index from the appending thread through a lock
+   or another synchronizing operation. */
+template <typename T> class AppendOnlyArray {
+  public:
+    AppendOnlyArray() = default;
+    AppendOnlyArray(const AppendOnlyArray &) = delete;
+    AppendOnlyArray(AppendOnlyArray &&) = delete;
+    auto operator=(const AppendOnlyArray &) -> AppendOnlyArray & = delete;
+    auto operator=(AppendOnlyArray &&) -> AppendOnlyArray & = delete;
+    ~AppendOnlyArray() = default;
+
+    /* Only for the appending thread */
+    [[nodiscard]] auto size() const -> size_t { return count; }
+
+    auto push_back(T value) -> T & {
+        const auto [chunk, offset] = locate(count);
+        if (!owned[chunk]) {
+            owned[chunk] = std::make_unique<T[]>(FIRST_CHUNK << chunk);
+            chunks[chunk].store(owned[chunk].get(), std::memory_order_release);
+        }
+        auto &slot = owned[chunk][offset];
+        slot = std::move(value);
+        count++;
+        return slot;
+    }
+
+    [[nodiscard]] auto operator[](size_t index) const -> const T & {
+        const auto [chunk, offset] = locate(index);
+        return chunks[chunk].load(std::memory_order_acquire)[offset];
+    }
+
+  private:
+    static constexpr size_t FIRST_CHUNK_BITS = 10;
+    static constexpr size_t FIRST_CHUNK = size_t{1} << FIRST_CHUNK_BITS;
+    /* Enough for 32-bit indices */
+    static constexpr size_t MAX_CHUNKS = 33 - FIRST_CHUNK_BITS;
+
+    std::array<std::unique_ptr<T[]>, MAX_CHUNKS> owned;
+    std::array<std::atomic<T *>, MAX_CHUNKS> chunks{};
+    size_t count = 0;
+
+    static auto locate(size_t index) -> std::pair<size_t, size_t> {
+        const size_t shifted = index + FIRST_CHUNK;
+        const size_t bit = std::bit_width(shifted) - 1;
+        return {bit - FIRST_CHUNK_BITS, shifted - (size_t{1} << bit)};
+    }
+};
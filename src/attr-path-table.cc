@@ -0,0 +1,123 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <nix/util/error.hh>
+#include <nlohmann/json.hpp>
+
+#include "attr-path-table.hh"
+
+AttrPathTable::AttrPathTable() {
+    nodes.push_back(Node{.parent = ROOT, .symbol = UINT32_MAX, .depth = 0});
+}
+
+auto AttrPathTable::childLocked(Index &index, AttrPathId parent,
+                                std::string_view name) -> AttrPathId {
+    uint32_t symbol = 0;
+    auto sym = index.symbols.find(name);
+    if (sym == index.symbols.end()) {
+        symbol = static_cast<uint32_t>(symbolNames.size());
+        const auto &stored = symbolNames.push_back(std::string(name));
+        index.symbols.emplace(std::string_view(stored), symbol);
+    } else {
+        symbol = sym->second;
+    }
+
+    const uint64_t key = (static_cast<uint64_t>(parent) << 32U) | symbol;
+    auto existing = index.children.find(key);
+    if (existing != index.children.end()) {
+        return existing->second;
+    }
+
+    if (nodes.size() >= UINT32_MAX) {
+        throw nix::Error("too many attribute paths");
+    }
+    auto id = static_cast<AttrPathId>(nodes.size());
+    nodes.push_back(Node{.parent = parent,
+                         .symbol = symbol,
+                         .depth = nodes[parent].depth + 1});
+    index.children.emplace(key, id);
+    return id;
+}
+
+auto AttrPathTable::namesOf(AttrPathId path) const
+    -> std::vector<std::string_view> {
+    std::vector<std::string_view> names(nodes[path].depth);
+    for (auto node = path; node != ROOT; node = nodes[node].parent) {
+        names[nodes[node].depth - 1] = symbolNames[nodes[node].symbol];
+    }
+    return names;
+}
+
+auto AttrPathTable::child(AttrPathId parent, std::string_view name)
+    -> AttrPathId {
+    auto index(index_.lock());
+    return childLocked(*index, parent, name);
+}
+
+auto AttrPathTable::intern(const nlohmann::json &path) -> AttrPathId {
+    auto index(index_.lock());
+    AttrPathId id = ROOT;
+    for (const auto &element : path) {
+        id = childLocked(*index, id, element.get_ref<const std::string &>());
+    }
+    return id;
+}
+
+auto AttrPathTable::parent(AttrPathId path) -> AttrPathId {
+    return nodes[path].parent;
+}
+
+auto AttrPathTable::depth(AttrPathId path) -> size_t {
+    return nodes[path].depth;
+}
+
+auto AttrPathTable::name(AttrPathId path) -> std::string {
+    if (path == ROOT) {
+        return "";
+    }
+    return symbolNames[nodes[path].symbol];
+}
+
+auto AttrPathTable::names(AttrPathId path) -> std::vector<std::string> {
+    auto names = namesOf(path);
+    return {names.begin(), names.end()};
+}
+
+auto AttrPathTable::toJson(AttrPathId path) -> nlohmann::json {
+    auto json = nlohmann::json::array();
+    for (const auto &name : namesOf(path)) {
+        json.emplace_back(name);
+    }
+    return json;
+}
+
+auto AttrPathTable::dotted(AttrPathId path) -> std::string {
+    std::string joined;
+    for (const auto &name : namesOf(path)) {
+        if (!joined.empty()) {
+            joined += '.';
+        }
+        joined += name;
+    }
+    return joined;
+}
+
+auto AttrPathTable::attrName(AttrPathId path) -> std::string {
+    std::string joined;
+    for (const auto &name : namesOf(path)) {
+        if (!joined.empty()) {
+            joined += '.';
+        }
+        // Quote names containing dots
+        if (name.find('.') != std::string_view::npos) {
+            joined += '"';
+            joined += name;
+            joined += '"';
+        } else {
+            joined += name;
+        }
+    }
+    return joined;
+}
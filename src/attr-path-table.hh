@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <nix/util/sync.hh>
+#include <nlohmann/json_fwd.hpp>
+
+#include "append-only-array.hh"
+
+using AttrPathId = uint32_t;
+
+/* Interns attribute paths as a trie of attribute names. Every path is a node
+   identified by a 32-bit id that links to its parent, so queues and maps can
+   hold plain integers instead of JSON arrays. The JSON and string forms are
+   only rebuilt on demand. Thread-safe: only creating paths takes a lock,
+   reading the ones known to a thread does not. */
+class AttrPathTable {
+  public:
+    /* The empty path, i.e. the root of the traversal */
+    static constexpr AttrPathId ROOT = 0;
+
+    AttrPathTable();
+
+    /* Id of the path `parent` + `name`, created if necessary */
+    [[nodiscard]] auto child(AttrPathId parent, std::string_view name)
+        -> AttrPathId;
+    /* Id of a path given as JSON array of attribute names */
+    [[nodiscard]] auto intern(const nlohmann::json &path) -> AttrPathId;
+
+    [[nodiscard]] auto parent(AttrPathId path) -> AttrPathId;
+    /* Number of attribute names in the path */
+    [[nodiscard]] auto depth(AttrPathId path) -> size_t;
+    /* The last attribute name of the path */
+    [[nodiscard]] auto name(AttrPathId path) -> std::string;
+    [[nodiscard]] auto names(AttrPathId path) -> std::vector<std::string>;
+
+    /* ["a", "b.c"] */
+    [[nodiscard]] auto toJson(AttrPathId path) -> nlohmann::json;
+    /* a.b.c, for messages */
+    [[nodiscard]] auto dotted(AttrPathId path) -> std::string;
+    /* a."b.c", the "attr" of a job, which findAlongAttrPath can parse */
+    [[nodiscard]] auto attrName(AttrPathId path) -> std::string;
+
+  private:
+    struct Node {
+        AttrPathId parent;
+        uint32_t symbol;
+        uint32_t depth;
+    };
+
+    /* Appended to with `index_` locked */
+    AppendOnlyArray<Node> nodes;
+    /* Elements do not move, so the keys of `symbols` stay valid */
+    AppendOnlyArray<std::string> symbolNames;
+
+    struct Index {
+        std::unordered_map<std::string_view, uint32_t> symbols;
+        /* (parent << 32 | symbol) -> child */
+        std::unordered_map<uint64_t, AttrPathId> children;
+    };
+
+    nix::Sync<Index> index_;
+
+    auto childLocked(Index &index, AttrPathId parent, std::string_view name)
+        -> AttrPathId;
+    [[nodiscard]] auto namesOf(AttrPathId path) const
+        -> std::vector<std::string_view>;
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* A thread handling the items pushed by other threads. Each round, it takes
+   everything pushed since the previous one and hands it to `handle`, in the
+   order it was pushed.
+
+   With a capacity, push() waits while the queued items weigh that much or
+   more, so a slow thread holds back the threads feeding it rather than
+   letting the queue grow. Items of weight 0 never wait. Once `handle` has
+   thrown, the thread stops, queued items are dropped, and push() and
+   finish() rethrow the error. */
+template <typename Item> class BackgroundQueue {
+  public:
+    using Handle = std::function<void(std::vector<Item> &items)>;
+    using Weight = std::function<size_t(const Item &item)>;
+
+    /* Without a capacity, push() never waits. Without `weight`, every item
+       weighs 1. */
+    explicit BackgroundQueue(Handle handle, size_t capacity = 0,
+                             Weight weight = nullptr)
+        : handle(std::move(handle)), capacity(capacity),
+          weight(std::move(weight)) {
+        thread = std::thread([this]() -> void { run(); });
+    }
+    BackgroundQueue(const BackgroundQueue &) = delete;
+    BackgroundQueue(BackgroundQueue &&) = delete;
+    auto operator=(const BackgroundQueue &) -> BackgroundQueue & = delete;
+    auto operator=(BackgroundQueue &&) -> BackgroundQueue & = delete;
+    ~BackgroundQueue() { stop(); }
+
+    void push(Item item) {
+        {
+            std::unique_lock lock(mutex);
+            const auto itemWeight = weigh(item);
+            space.wait(lock, [&]() -> bool {
+                return error || itemWeight == 0 || !full();
+            });
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            queued += itemWeight;
+            items.push_back(std::move(item));
+        }
+        wakeup.notify_one();
+    }
+
+    /* Like push(), but leaves `item` alone and returns false instead of
+       waiting while the queue is full */
+    [[nodiscard]] auto tryPush(Item &item) -> bool {
+        {
+            const std::lock_guard lock(mutex);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            const auto itemWeight = weigh(item);
+            if (itemWeight > 0 && full()) {
+                return false;
+            }
+            queued += itemWeight;
+            items.push_back(std::move(item));
+        }
+        wakeup.notify_one();
+        return true;
+    }
+
+    /* Handles the remaining items and stops the thread */
+    void finish() {
+        stop();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+  private:
+    Handle handle;
+    size_t capacity;
+    Weight weight;
+
+    std::mutex mutex;
+    /* Signalled when there are items to handle */
+    std::condition_variable wakeup;
+    /* Signalled when the items have been taken */
+    std::condition_variable space;
+    std::vector<Item> items;
+    /* The weight of `items` */
+    size_t queued = 0;
+    bool finishing = false;
+    std::exception_ptr error;
+
+    std::thread thread;
+
+    [[nodiscard]] auto weigh(const Item &item) const -> size_t {
+        return weight ? weight(item) : 1;
+    }
+
+    [[nodiscard]] auto full() const -> bool {
+        return capacity > 0 && queued >= capacity;
+    }
+
+    void stop() {
+        {
+            const std::lock_guard lock(mutex);
+            finishing = true;
+        }
+        wakeup.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void run() {
+        try {
+            std::vector<Item> batch;
+            while (true) {
+                {
+                    std::unique_lock lock(mutex);
+                    wakeup.wait(lock, [this]() -> bool {
+                        return !items.empty() || finishing;
+                    });
+                    if (items.empty()) {
+                        return;
+                    }
+                    batch.clear();
+                    batch.swap(items);
+                    queued = 0;
+                }
+                space.notify_all();
+                handle(batch);
+            }
+        } catch (...) {
+            {
+                const std::lock_guard lock(mutex);
+                error = std::current_exception();
+                items.clear();
+                queued = 0;
+            }
+            space.notify_all();
+        }
+    }
+};
@@ -1,70 +1,122 @@
 #include <cstring>
 #include <unistd.h>
 #include <cerrno>
-#include <cstdlib>
-// NOLINTBEGIN(modernize-deprecated-headers)
-// misc-include-cleaner wants these headers rather than the C++ version
-#include <stdio.h>
-#include <string.h>
-// NOLINTEND(modernize-deprecated-headers)
-#include <cstdio>
-#include <nix/util/error.hh>
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <nix/util/file-descriptor.hh>
 // NOLINTBEGIN(misc-header-include-cycle)
 #include <nix/util/signals.hh>
 #include <nix/util/signals-impl.hh>
 // NOLINTEND(misc-header-include-cycle)
-#include <string>
+#include <array>
+#include <optional>
 #include <string_view>
 
 #include "buffered-io.hh"
-#include "strings-portable.hh"
 
-[[nodiscard]] auto tryWriteLine(int file_descriptor, std::string str) -> int {
-    str += "\n";
-    std::string_view string_view{str};
-    while (!string_view.empty()) {
+namespace {
+constexpr size_t READ_CHUNK_SIZE = static_cast<size_t>(64) * 1024;
+} // namespace
+
+[[nodiscard]] auto tryWriteFrame(int file_descriptor, FrameHeader header,
+                                 std::string_view payload) -> int {
+    header.size = static_cast<uint32_t>(payload.size());
+
+    std::array<struct iovec, 2> iov = {{
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+        {.iov_base = const_cast<char *>(payload.data()),
+         .iov_len = payload.size()},
+    }};
+    size_t first = 0;
+
+    while (first < iov.size()) {
         nix::checkInterrupt();
         // NOLINTNEXTLINE(misc-include-cleaner)
         const ssize_t res =
-            write(file_descriptor, string_view.data(), string_view.size());
-        if (res == -1 && errno != EINTR) {
+            writev(file_descriptor, &iov.at(first),
+                   static_cast<int>(iov.size() - first));
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             return -errno;
         }
-        if (res > 0) {
-            string_view.remove_prefix(res);
+        auto written = static_cast<size_t>(res);
+        while (first < iov.size() && written >= iov.at(first).iov_len) {
+            written -= iov.at(first).iov_len;
+            first++;
+        }
+        if (first < iov.size()) {
+            auto &partial = iov.at(first);
+            partial.iov_base = static_cast<char *>(partial.iov_base) + written;
+            partial.iov_len -= written;
         }
     }
     return 0;
 }
 
-LineReader::LineReader(int file_descriptor)
-    : stream(fdopen(file_descriptor, "r")) {
-    if (stream == nullptr) {
-        // NOLINTNEXTLINE(clang-diagnostic-missing-designated-field-initializers)
-        throw nix::Error("fdopen(%d) failed: %s", file_descriptor,
-                         get_error_name(errno));
-    }
+void enlargePipeBuffer([[maybe_unused]] int file_descriptor) {
+#ifdef F_SETPIPE_SZ
+    static constexpr int PIPE_BUFFER_SIZE = 1024 * 1024;
+    // Fails with EPERM above /proc/sys/fs/pipe-max-size, the default buffer
+    // still works in that case.
+    (void)fcntl(file_descriptor, F_SETPIPE_SZ, PIPE_BUFFER_SIZE);
+#endif
 }
 
-LineReader::LineReader(LineReader &&other) noexcept
-    : stream(other.stream.release()), buffer(other.buffer.release()),
-      len(other.len) {
-    other.stream = nullptr;
-    other.len = 0;
-}
-
-[[nodiscard]] auto LineReader::readLine() -> std::string_view {
-    char *buf = buffer.release();
-    const ssize_t read = getline(&buf, &len, stream.get());
-    buffer.reset(buf);
+FrameReader::FrameReader(int file_descriptor)
+    : fd(file_descriptor), buffer(READ_CHUNK_SIZE) {}
 
-    if (read == -1) {
-        return {}; // Return an empty string_view in case of error
+auto FrameReader::fill(size_t needed) -> bool {
+    if (end - start >= needed) {
+        return true;
+    }
+    // Move the unconsumed tail to the front and make room for the rest
+    if (start > 0) {
+        std::memmove(buffer.data(), buffer.data() + start, end - start);
+        end -= start;
+        start = 0;
+    }
+    if (buffer.size() < needed) {
+        buffer.resize(needed);
     }
+    while (end < needed) {
+        nix::checkInterrupt();
+        const ssize_t res =
+            read(fd.get(), buffer.data() + end, buffer.size() - end);
+        if (res == 0) {
+            return false;
+        }
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        end += static_cast<size_t>(res);
+    }
+    return true;
+}
 
-    nix::checkInterrupt();
+[[nodiscard]] auto FrameReader::readFrame() -> std::optional<Frame> {
+    if (!fill(sizeof(FrameHeader))) {
+        return std::nullopt;
+    }
+    Frame frame;
+    std::memcpy(&frame.header, buffer.data() + start, sizeof(FrameHeader));
 
-    // Remove trailing newline
-    char const *line = buffer.get();
-    return {line, static_cast<size_t>(read) - 1};
+    const size_t total = sizeof(FrameHeader) + frame.header.size;
+    if (!fill(total)) {
+        return std::nullopt;
+    }
+    frame.payload = {buffer.data() + start + sizeof(FrameHeader),
+                     frame.header.size};
+    start += total;
+    if (start == end) {
+        start = end = 0;
+    }
+    return frame;
 }
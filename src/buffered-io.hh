@@ -1,41 +1,102 @@
 #pragma once
-#include <cstdio>
-#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
 #include <string_view>
-#include <memory>
-#include <cstdlib>
+#include <vector>
 
-[[nodiscard]] auto tryWriteLine(int file_descriptor, std::string str) -> int;
+#include <nix/util/file-descriptor.hh>
 
-struct FileDeleter {
-    void operator()(FILE *file) const {
-        if (file != nullptr) {
-            std::fclose(file); // NOLINT(cppcoreguidelines-owning-memory)
-        }
-    }
+/* Messages between the collector and its worker are framed as a fixed-size
+   header followed by `size` bytes of payload. The header carries everything
+   the collector needs for scheduling, so job payloads can be forwarded to the
+   output without being parsed. */
+enum class FrameType : uint8_t {
+    /* worker -> collector: ready for the next command. The payload is the
+       worker's maximum RSS in KiB as uint64_t. */
+    Next,
+    /* worker -> collector: exiting, start a new worker */
+    Restart,
+    /* worker -> collector: the worker failed, JSON payload with "error" */
+    Error,
+    /* worker -> collector: a job, JSON payload in output format */
+    Job,
+    /* worker -> collector: attribute names to recurse into, separated by
+       NUL bytes, `childCount` of them */
+    Attrs,
+    /* collector -> worker: JSON array of `childCount` attribute paths to
+       evaluate, answered by one Job or Attrs frame each */
+    Do,
+    /* collector -> worker: no more work */
+    Exit,
+    /* worker -> collector: sent once before the first Next with
+       --result-cache. The payload is the fingerprint of the locked flake,
+       empty if there is none */
+    Fingerprint,
 };
 
-struct MemoryDeleter {
-    void operator()(void *ptr) const {
-        // NOLINTBEGIN(cppcoreguidelines-owning-memory,cppcoreguidelines-no-malloc)
-        std::free(ptr);
-        // NOLINTEND(cppcoreguidelines-owning-memory,cppcoreguidelines-no-malloc)
-    }
+/* Flags in FrameHeader::status. */
+enum FrameStatus : uint8_t {
+    FrameStatusOk = 0,
+    /* Job: the job contains an "error" */
+    FrameStatusFailed = 1U << 0U,
+    /* Job: the job has named constituents and needs rewriting before
+       output */
+    FrameStatusAggregate = 1U << 1U,
+    /* Next: the worker passed --respawn-threshold and will restart soon */
+    FrameStatusRespawn = 1U << 2U,
 };
 
-class LineReader {
+struct FrameHeader {
+    uint32_t size = 0;
+    FrameType type = FrameType::Next;
+    uint8_t status = FrameStatusOk;
+    uint16_t reserved = 0;
+    /* Identifies the attribute path a reply belongs to */
+    uint32_t attr = 0;
+    uint32_t childCount = 0;
+    /* Job and Attrs: evaluation cost of the attribute path, recorded with
+       --history-file */
+    uint32_t evalMicros = 0;
+    uint32_t rssDeltaKiB = 0;
+};
+static_assert(sizeof(FrameHeader) == 24);
+
+struct Frame {
+    FrameHeader header;
+    /* Valid until the next call to FrameReader::readFrame() */
+    std::string_view payload;
+};
+
+/* Writes header and payload with a single writev() without copying the
+   payload. `header.size` is filled in from the payload. Returns 0 or
+   -errno. */
+[[nodiscard]] auto tryWriteFrame(int file_descriptor, FrameHeader header,
+                                 std::string_view payload = {}) -> int;
+
+/* Grow the kernel buffer of a pipe so that a worker can write large replies
+   without waiting for the collector. Best effort, only has an effect on
+   Linux. */
+void enlargePipeBuffer(int file_descriptor);
+
+class FrameReader {
   public:
-    LineReader(const LineReader &) = delete;
-    explicit LineReader(int file_descriptor);
-    auto operator=(const LineReader &) -> LineReader & = delete;
-    auto operator=(LineReader &&) -> LineReader & = delete;
-    ~LineReader() = default;
+    explicit FrameReader(int file_descriptor);
+    FrameReader(const FrameReader &) = delete;
+    FrameReader(FrameReader &&other) noexcept = default;
+    auto operator=(const FrameReader &) -> FrameReader & = delete;
+    auto operator=(FrameReader &&) -> FrameReader & = delete;
+    ~FrameReader() = default;
 
-    LineReader(LineReader &&other) noexcept;
-    [[nodiscard]] auto readLine() -> std::string_view;
+    /* Returns std::nullopt on EOF or read errors. */
+    [[nodiscard]] auto readFrame() -> std::optional<Frame>;
 
   private:
-    std::unique_ptr<FILE, FileDeleter> stream = nullptr;
-    std::unique_ptr<char, MemoryDeleter> buffer = nullptr;
-    size_t len = 0;
+    nix::AutoCloseFD fd;
+    std::vector<char> buffer;
+    /* Unconsumed bytes are buffer[start, end) */
+    size_t start = 0;
+    size_t end = 0;
+
+    [[nodiscard]] auto fill(size_t needed) -> bool;
 };
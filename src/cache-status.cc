@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <nix/store/derivations.hh>
+#include <nix/store/globals.hh>
+#include <nix/store/local-fs-store.hh>
+#include <nix/store/path-with-outputs.hh>
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/error.hh>
+#include <nix/util/logging.hh>
+#include <nix/util/terminal.hh>
+#include <nlohmann/json.hpp>
+
+#include "cache-status.hh"
+#include "buffered-io.hh"
+#include "json-fields.hh"
+
+namespace {
+
+/* The --check-cache-status fields of a job */
+auto cacheStatusFields(nix::Store &store, const PathStatusCache::Needed &needed)
+    -> nlohmann::json {
+    std::vector<std::string> neededBuilds;
+    if (!needed.builds.empty()) {
+        // TODO: can we expose the topological sort order as a graph?
+        auto sorted = store.topoSortPaths(needed.builds);
+        std::ranges::reverse(sorted);
+        for (const auto &path : sorted) {
+            neededBuilds.push_back(store.printStorePath(path));
+        }
+    }
+
+    std::vector<const nix::StorePath *> substitutes;
+    for (const auto &path : needed.substitutes) {
+        substitutes.push_back(&path);
+    }
+    std::ranges::sort(
+        substitutes,
+        [](const nix::StorePath *lhs, const nix::StorePath *rhs) -> bool {
+            if (lhs->name() == rhs->name()) {
+                return lhs->to_string() < rhs->to_string();
+            }
+            return lhs->name() < rhs->name();
+        });
+    std::vector<std::string> neededSubstitutes;
+    for (const auto *path : substitutes) {
+        neededSubstitutes.push_back(store.printStorePath(*path));
+    }
+
+    std::string cacheStatus = "notBuilt";
+    if (needed.builds.empty() && !needed.unknown) {
+        // Local if there is nothing to build or substitute, Cached if there
+        // is only something to substitute
+        cacheStatus = needed.substitutes.empty() ? "local" : "cached";
+    }
+
+    return {
+        // Deprecated field
+        {"isCached", cacheStatus != "notBuilt"},
+        {"cacheStatus", cacheStatus},
+        {"neededBuilds", neededBuilds},
+        {"neededSubstitutes", neededSubstitutes},
+    };
+}
+
+/* Appends the fields of `extra` to the JSON object `job`, which is left as
+   it is otherwise */
+auto appendFields(std::string_view job, const nlohmann::json &extra)
+    -> std::string {
+    std::string result(job.substr(0, job.rfind('}')));
+    result += ',';
+    result += std::string_view(extra.dump()).substr(1);
+    return result;
+}
+
+/* For the "error" field of a job, which is printed as well, like the
+   errors of the workers */
+auto errorMessage(const nix::Error &error) -> std::string {
+    const auto &msg = error.msg();
+    nix::logger->log(nix::lvlError, msg);
+    return nix::filterANSIEscapes(msg, true);
+}
+
+} // namespace
+
+auto PathStatusCache::needed(
+    const std::vector<nix::StorePathWithOutputs> &paths) const
+    -> std::optional<Needed> {
+    Needed result;
+    std::set<Key> seen;
+    std::vector<const nix::StorePathWithOutputs *> todo;
+    for (const auto &path : paths) {
+        todo.push_back(&path);
+    }
+    while (!todo.empty()) {
+        const auto *item = todo.back();
+        todo.pop_back();
+        Key key{item->path, item->outputs};
+        if (seen.contains(key)) {
+            continue;
+        }
+        auto entry = entries.find(key);
+        if (entry == entries.end()) {
+            return std::nullopt;
+        }
+        seen.insert(std::move(key));
+
+        switch (entry->second.status) {
+        case Status::Build:
+            result.builds.insert(item->path);
+            break;
+        case Status::Substitute:
+            result.substitutes.insert(item->path);
+            break;
+        case Status::Unknown:
+            result.unknown = true;
+            break;
+        case Status::Done:
+            break;
+        }
+        for (const auto &next : entry->second.next) {
+            todo.push_back(&next);
+        }
+    }
+    return result;
+}
+
+void PathStatusCache::learn(nix::LocalFSStore &store,
+                            const std::vector<nix::StorePathWithOutputs> &paths,
+                            const nix::MissingPaths &missing,
+                            const nix::SubstitutablePathInfos &infos) {
+    std::vector<nix::StorePathWithOutputs> todo(paths);
+    while (!todo.empty()) {
+        auto item = std::move(todo.back());
+        todo.pop_back();
+        Key key{item.path, item.outputs};
+        if (entries.contains(key)) {
+            continue;
+        }
+
+        Entry entry{.status = Status::Done, .next = {}};
+        if (missing.unknown.contains(item.path)) {
+            entry.status = Status::Unknown;
+        } else if (item.outputs.empty()) {
+            if (missing.willSubstitute.contains(item.path)) {
+                entry.status = Status::Substitute;
+                auto info = infos.find(item.path);
+                if (info != infos.end()) {
+                    for (const auto &reference : info->second.references) {
+                        entry.next.push_back({reference, {}});
+                    }
+                }
+            }
+        } else {
+            auto drv = store.readDerivation(item.path);
+            auto outputs = drv.outputsAndOptPaths(store);
+            /* willBuild is about the derivation, whichever of its outputs
+               made it be built. These outputs only need it if one of them
+               is neither there nor substituted. */
+            const bool build =
+                missing.willBuild.contains(item.path) &&
+                std::ranges::any_of(outputs, [&](const auto &output) -> bool {
+                    const auto &path = output.second.second;
+                    return item.outputs.contains(output.first) &&
+                           (!path || (!missing.willSubstitute.contains(*path) &&
+                                      !store.isValidPath(*path)));
+                });
+            if (build) {
+                entry.status = Status::Build;
+                for (const auto &[inputDrvPath, inputNode] :
+                     drv.inputDrvs.map) {
+                    entry.next.push_back({inputDrvPath, inputNode.value});
+                }
+                for (const auto &inputSrc : drv.inputSrcs) {
+                    entry.next.push_back({inputSrc, {}});
+                }
+            } else {
+                for (const auto &[outputName, output] : outputs) {
+                    if (output.second && item.outputs.contains(outputName)) {
+                        entry.next.push_back({*output.second, {}});
+                    }
+                }
+            }
+        }
+
+        todo.insert(todo.end(), entry.next.begin(), entry.next.end());
+        entries.emplace(std::move(key), std::move(entry));
+    }
+}
+
+CacheStatusResolver::CacheStatusResolver(nix::ref<nix::Store> store,
+                                         Emit emit, size_t capacity)
+    : store(std::move(store)), emit(std::move(emit)),
+      queue([this](std::vector<Job> &jobs) -> void { resolve(jobs); },
+            capacity,
+            [](const Job &job) -> size_t { return job.payload.size(); }) {}
+
+void CacheStatusResolver::submit(std::string payload, uint8_t status) {
+    queue.push({.payload = std::move(payload), .status = status});
+}
+
+void CacheStatusResolver::finish() { queue.finish(); }
+
+void CacheStatusResolver::resolve(std::vector<Job> &jobs) {
+    // Reading derivations needs a local store
+    auto localStore = store.dynamic_pointer_cast<nix::LocalFSStore>();
+    if (!localStore || nix::settings.readOnlyMode) {
+        for (const auto &job : jobs) {
+            emit(job.payload, job.status);
+        }
+        return;
+    }
+
+    /* The paths each job needs, as the worker used to query them: its
+       outputs and the input derivations */
+    std::vector<bool> isDerivation(jobs.size());
+    std::vector<std::vector<nix::StorePathWithOutputs>> paths(jobs.size());
+    /* Like the worker did, a store error only fails the job it is about */
+    std::vector<std::optional<std::string>> errors(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if ((jobs[i].status & FrameStatusFailed) != 0) {
+            continue;
+        }
+        try {
+            const JsonFields fields(jobs[i].payload);
+            auto drvPath = fields.get("drvPath");
+            if (!drvPath.has_value()) {
+                continue;
+            }
+            isDerivation[i] = true;
+            for (const auto &output : fields.get("outputs").value()) {
+                if (!output.is_null()) {
+                    paths[i].push_back(nix::followLinksToStorePathWithOutputs(
+                        *store, output.get<std::string>()));
+                }
+            }
+            auto drv = localStore->readDerivation(
+                store->parseStorePath(drvPath->get<std::string>()));
+            for (const auto &[inputDrvPath, inputNode] : drv.inputDrvs.map) {
+                paths[i].push_back(
+                    nix::StorePathWithOutputs{inputDrvPath, inputNode.value});
+            }
+        } catch (const nix::Error &e) {
+            errors[i] = errorMessage(e);
+        }
+    }
+
+    std::vector<std::optional<PathStatusCache::Needed>> needed(jobs.size());
+    std::vector<nix::StorePathWithOutputs> unknownPaths;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!isDerivation[i] || errors[i].has_value()) {
+            continue;
+        }
+        needed[i] = pathStatus.needed(paths[i]);
+        if (needed[i].has_value()) {
+            counters.hits++;
+        } else {
+            counters.misses++;
+            unknownPaths.insert(unknownPaths.end(), paths[i].begin(),
+                                paths[i].end());
+        }
+    }
+
+    if (!unknownPaths.empty()) {
+        try {
+            query(*localStore, unknownPaths);
+        } catch (const nix::Error &) {
+            // Find out which jobs the error is about
+            for (size_t i = 0; i < jobs.size(); i++) {
+                if (!isDerivation[i] || errors[i].has_value() ||
+                    needed[i].has_value()) {
+                    continue;
+                }
+                try {
+                    query(*localStore, paths[i]);
+                } catch (const nix::Error &e) {
+                    errors[i] = errorMessage(e);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (!isDerivation[i]) {
+            emit(jobs[i].payload, jobs[i].status);
+            continue;
+        }
+        if (!errors[i].has_value()) {
+            try {
+                if (!needed[i].has_value()) {
+                    needed[i] = pathStatus.needed(paths[i]);
+                }
+                emit(appendFields(jobs[i].payload,
+                                  cacheStatusFields(*store, needed[i].value())),
+                     jobs[i].status);
+                continue;
+            } catch (const nix::Error &e) {
+                errors[i] = errorMessage(e);
+            }
+        }
+        emit(appendFields(jobs[i].payload, {{"error", *errors[i]}}),
+             static_cast<uint8_t>(jobs[i].status | FrameStatusFailed));
+    }
+}
+
+void CacheStatusResolver::query(
+    nix::LocalFSStore &localStore,
+    const std::vector<nix::StorePathWithOutputs> &paths) {
+    auto missing = store->queryMissing(nix::toDerivedPaths(paths));
+
+    // References of the substitutes, mostly from the cache queryMissing()
+    // has just filled
+    nix::StorePathCAMap substitutes;
+    for (const auto &path : missing.willSubstitute) {
+        substitutes.emplace(path, std::nullopt);
+    }
+    nix::SubstitutablePathInfos infos;
+    if (!substitutes.empty()) {
+        store->querySubstitutablePathInfos(substitutes, infos);
+    }
+    pathStatus.learn(localStore, paths, missing, infos);
+}
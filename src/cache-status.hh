@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <nix/store/local-fs-store.hh>
+#include <nix/store/path-with-outputs.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/ref.hh>
+
+#include "background-queue.hh"
+
+/* Whether the paths needed by jobs are valid, can be substituted or have to
+   be built, as learned from the queryMissing() calls of the whole run.
+   Lives in the main process, so what one worker's jobs needed is known for
+   the jobs of all other workers, and across worker restarts. Negative
+   results (paths nobody can substitute) are kept as well. */
+class PathStatusCache {
+  public:
+    /* What a job needs */
+    struct Needed {
+        nix::StorePathSet builds;
+        nix::StorePathSet substitutes;
+        bool unknown = false;
+    };
+
+    /* std::nullopt if a path reachable from `paths` is not known yet */
+    [[nodiscard]] auto
+    needed(const std::vector<nix::StorePathWithOutputs> &paths) const
+        -> std::optional<Needed>;
+
+    /* Records every path reachable from `paths`, given the result of one
+       queryMissing() call for them. Follows the traversal of queryMissing():
+       a derivation that will be built needs its inputs if one of the
+       requested outputs is missing, any other derivation only the requested
+       outputs, and a substituted path its references. */
+    void learn(nix::LocalFSStore &store,
+               const std::vector<nix::StorePathWithOutputs> &paths,
+               const nix::MissingPaths &missing,
+               const nix::SubstitutablePathInfos &infos);
+
+  private:
+    enum class Status : uint8_t { Done, Build, Substitute, Unknown };
+
+    struct Entry {
+        Status status;
+        /* The paths this one needs in turn */
+        std::vector<nix::StorePathWithOutputs> next;
+    };
+
+    using Key = std::pair<nix::StorePath, nix::StringSet>;
+
+    std::map<Key, Entry> entries;
+};
+
+/* Adds the --check-cache-status fields to jobs in the main process rather
+   than in the workers.
+
+   Collectors submit finished jobs and go back to evaluation. A single
+   thread takes everything queued since its last round, asks the store for
+   the missing paths of all those jobs with one queryMissing() call and
+   emits the annotated jobs. Dependencies shared between jobs are looked up
+   once per round, and the substituter round trips no longer block the
+   evaluation workers. Jobs are emitted in the order they were submitted.
+   Jobs whose paths are all in the PathStatusCache skip the store. Collectors
+   wait in submit() while the thread is too far behind, rather than letting
+   the queue grow. */
+class CacheStatusResolver {
+  public:
+    using Emit = std::function<void(std::string_view payload, uint8_t status)>;
+
+    struct Stats {
+        /* Jobs resolved from the PathStatusCache alone */
+        size_t hits = 0;
+        /* Jobs that needed a queryMissing() call */
+        size_t misses = 0;
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 16 * 1024 * 1024;
+
+    /* submit() waits while jobs of `capacity` bytes are queued */
+    CacheStatusResolver(nix::ref<nix::Store> store, Emit emit,
+                        size_t capacity = DEFAULT_CAPACITY);
+
+    /* `payload` is a job in output format, `status` its FrameStatus.
+       Rethrows the error that stopped the thread, if any. */
+    void submit(std::string payload, uint8_t status);
+
+    /* Emits the remaining jobs and stops the thread. Rethrows the error
+       that stopped it, if any. */
+    void finish();
+
+    /* Only complete after finish() */
+    [[nodiscard]] auto stats() const -> Stats { return counters; }
+
+  private:
+    struct Job {
+        std::string payload;
+        uint8_t status;
+    };
+
+    nix::ref<nix::Store> store;
+    Emit emit;
+
+    /* Only touched by the thread */
+    PathStatusCache pathStatus;
+    Stats counters;
+
+    /* Last, its thread uses the members above */
+    BackgroundQueue<Job> queue;
+
+    void resolve(std::vector<Job> &jobs);
+    /* Adds what `paths` need to pathStatus */
+    void query(nix::LocalFSStore &localStore,
+               const std::vector<nix::StorePathWithOutputs> &paths);
+};
@@ -1,5 +1,8 @@
 #include <fnmatch.h>
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -7,7 +10,9 @@
 #include <set>
 #include <unordered_map>
 #include <functional>
-#include <variant>
+#include <mutex>
+#include <string_view>
+#include <utility>
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 #include <nix/store/derivations.hh>
@@ -18,6 +23,7 @@
 #include <nix/util/error.hh>
 #include <nix/util/fmt.hh>
 #include <nix/util/file-system.hh>
+#include <nix/util/thread-pool.hh>
 #include <nix/util/types.hh>
 #include <nix/util/util.hh>
 
@@ -25,71 +31,20 @@
 #include "output-stream-lock.hh"
 
 namespace {
-// This is copied from `libutil/topo-sort.hh` in Nix and slightly modified.
-// However, I needed a way to use strings as identifiers to sort, but still be
-// able to put AggregateJob objects into this function since I'd rather not have
-// to transform back and forth between a list of strings and AggregateJobs in
-// resolveNamedConstituents.
-auto topoSort(const std::set<AggregateJob> &items)
-    -> std::vector<AggregateJob> {
-    std::vector<AggregateJob> sorted;
-    std::set<std::string> visited;
-    std::set<std::string> parents;
-
-    std::map<std::string, AggregateJob> dictIdentToObject;
-    for (const auto &item : items) {
-        dictIdentToObject.insert({item.name, item});
-    }
-
-    std::function<void(const std::string &path, const std::string *parent)>
-        dfsVisit;
-
-    dfsVisit = [&](const std::string &path, const std::string *parent) -> void {
-        if (parents.contains(path)) {
-            dictIdentToObject.erase(path);
-            dictIdentToObject.erase(*parent);
-            std::set<std::string> remaining;
-            for (auto &[key, value] : dictIdentToObject) {
-                remaining.insert(key);
-            }
-            throw DependencyCycle(path, *parent, remaining);
-        }
-
-        if (!visited.insert(path).second) {
-            return;
-        }
-        parents.insert(path);
-
-        const std::set<std::string> references =
-            dictIdentToObject[path].dependencies;
-
-        for (const auto &ref : references) {
-            /* Don't traverse into items that don't exist in our starting set.
-             */
-            if (ref != path && dictIdentToObject.contains(ref)) {
-                dfsVisit(ref, &path);
-            }
-        }
-
-        sorted.push_back(dictIdentToObject[path]);
-        parents.erase(path);
-    };
-
-    for (auto &[key, value] : dictIdentToObject) {
-        dfsVisit(key, nullptr);
-    }
-
-    return sorted;
-}
-
 auto insertMatchingConstituents(
     const std::string &childJobName, const std::string &jobName,
-    const std::function<bool(const std::string &, const nlohmann::json &)>
-        &isBroken,
-    const std::map<std::string, nlohmann::json> &jobs,
+    const std::function<bool(const std::string &, const JobRecord &)> &isBroken,
+    const std::map<std::string, JobRecord> &jobs,
     std::set<std::string> &results) -> bool {
     bool expansionFound = false;
-    for (const auto &[currentJobName, job] : jobs) {
+    /* Jobs are sorted by name, so the ones starting with the part of the
+       pattern before the first wildcard are next to each other. Only those
+       can match. */
+    const auto prefix =
+        childJobName.substr(0, childJobName.find_first_of("*?[\\"));
+    for (auto it = jobs.lower_bound(prefix);
+         it != jobs.end() && it->first.starts_with(prefix); ++it) {
+        const auto &[currentJobName, job] = *it;
         // Never select the job itself as constituent. Trivial way
         // to avoid obvious cycles.
         if (currentJobName == jobName) {
@@ -110,15 +65,15 @@ auto insertMatchingConstituents(
 namespace {
 void addConstituents(nlohmann::json &job, nix::Derivation &drv,
                      const std::set<std::string> &dependencies,
-                     const std::map<std::string, nlohmann::json> &jobs,
-                     const nix::ref<nix::LocalFSStore> &store) {
+                     const std::map<std::string, JobRecord> &jobs,
+                     const nix::ref<nix::LocalFSStore> &store,
+                     DerivationCache &derivations) {
     for (const auto &childJobName : dependencies) {
-        auto childDrvPath = store->parseStorePath(
-            std::string(jobs.find(childJobName)->second["drvPath"]));
-        auto childDrv = store->readDerivation(childDrvPath);
+        auto childDrvPath =
+            store->parseStorePath(jobs.find(childJobName)->second.drvPath);
         job["constituents"].push_back(store->printStorePath(childDrvPath));
         drv.inputDrvs.map[childDrvPath].value = {
-            childDrv.outputs.begin()->first};
+            derivations.firstOutput(*store, childDrvPath)};
     }
 }
 
@@ -173,90 +128,384 @@ void addBrokenJobsError(
     }
     job["error"] = errorStream.str();
 }
+
+/* The constituents of the aggregate `job`, from the jobs known so far */
+auto resolveAggregate(const std::string &jobName, const nlohmann::json &job,
+                      const std::map<std::string, JobRecord> &jobs)
+    -> AggregateJob {
+    const bool globConstituents = job.value<bool>("globConstituents", false);
+    std::unordered_map<std::string, std::string> brokenJobs;
+    std::set<std::string> results;
+
+    auto isBroken = [&brokenJobs, &jobName](const std::string &childJobName,
+                                            const JobRecord &job) -> bool {
+        if (job.error.has_value()) {
+            const std::string &error = *job.error;
+            nix::logger->log(
+                nix::lvlError,
+                nix::fmt("aggregate job '%s' references broken job '%s': %s",
+                         jobName, childJobName, error));
+            brokenJobs[childJobName] = error;
+            return true;
+        }
+        return false;
+    };
+
+    for (const std::string childJobName : job.at("namedConstituents")) {
+        auto childJobIter = jobs.find(childJobName);
+        if (childJobIter == jobs.end()) {
+            if (!globConstituents) {
+                nix::logger->log(nix::lvlError,
+                                 nix::fmt("aggregate job '%s' references "
+                                          "non-existent job '%s'",
+                                          jobName, childJobName));
+                brokenJobs[childJobName] = "does not exist";
+            } else if (!insertMatchingConstituents(childJobName, jobName,
+                                                   isBroken, jobs, results)) {
+                nix::warn("aggregate job '%s' references constituent "
+                          "glob pattern '%s' with no matches",
+                          jobName, childJobName);
+                brokenJobs[childJobName] =
+                    "constituent glob pattern had no matches";
+            }
+        } else if (!isBroken(childJobName, childJobIter->second)) {
+            results.insert(childJobName);
+        }
+    }
+
+    return {.name = jobName,
+            .dependencies = std::move(results),
+            .brokenJobs = std::move(brokenJobs)};
+}
+
+void rewriteAggregate(std::map<std::string, JobRecord> &jobs,
+                      const AggregateJob &aggregateJob,
+                      const nix::ref<nix::LocalFSStore> &store,
+                      DerivationCache &derivations,
+                      const nix::Path &gcRootsDir) {
+    auto &record = jobs.find(aggregateJob.name)->second;
+    auto &job = record.aggregate.value();
+    auto drvPath = store->parseStorePath(record.drvPath);
+    auto drv = store->readDerivation(drvPath);
+
+    if (aggregateJob.brokenJobs.empty()) {
+        addConstituents(job, drv, aggregateJob.dependencies, jobs, store,
+                        derivations);
+        if (rewriteDerivation(job, drv, drvPath, store, gcRootsDir)) {
+            // Aggregates depending on this one use the new derivation
+            record.drvPath = job["drvPath"].get<std::string>();
+        }
+    }
+
+    job.erase("namedConstituents");
+
+    if (!aggregateJob.brokenJobs.empty()) {
+        addBrokenJobsError(job, aggregateJob.brokenJobs);
+    }
+}
+
+/* Fails the aggregates depending on a cycle, like those naming a broken
+   job: their constituents would otherwise include the derivation of a cycle
+   member that was never rewritten. Aggregates depending on one of those
+   fail in turn, which the topological order allows in a single pass. */
+void breakCycleDependents(SortedAggregates &resolved) {
+    std::unordered_map<std::string, std::string> broken;
+    for (const auto &cycle : resolved.cycles) {
+        for (const auto &member : cycle.aggregates) {
+            broken.emplace(member, cycle.message());
+        }
+    }
+    if (broken.empty()) {
+        return;
+    }
+    for (auto &aggregateJob : resolved.sorted) {
+        bool dependsOnCycle = false;
+        for (auto it = aggregateJob.dependencies.begin();
+             it != aggregateJob.dependencies.end();) {
+            auto reason = broken.find(*it);
+            if (reason == broken.end()) {
+                ++it;
+                continue;
+            }
+            aggregateJob.brokenJobs[*it] = reason->second;
+            it = aggregateJob.dependencies.erase(it);
+            dependsOnCycle = true;
+        }
+        if (dependsOnCycle) {
+            broken.emplace(aggregateJob.name,
+                           "depends on a dependency cycle");
+        }
+    }
+}
 } // namespace
 
-auto resolveNamedConstituents(const std::map<std::string, nlohmann::json> &jobs)
-    -> std::variant<std::vector<AggregateJob>, DependencyCycle> {
-    std::set<AggregateJob> aggregateJobs;
-    for (auto const &[jobName, job] : jobs) {
-        auto named = job.find("namedConstituents");
-        if (named != job.end() && !named->empty()) {
-            const bool globConstituents =
-                job.value<bool>("globConstituents", false);
-            std::unordered_map<std::string, std::string> brokenJobs;
-            std::set<std::string> results;
-
-            auto isBroken = [&brokenJobs,
-                             &jobName](const std::string &childJobName,
-                                       const nlohmann::json &job) -> bool {
-                if (job.find("error") != job.end()) {
-                    const std::string error = job["error"];
-                    nix::logger->log(
-                        nix::lvlError,
-                        nix::fmt(
-                            "aggregate job '%s' references broken job '%s': %s",
-                            jobName, childJobName, error));
-                    brokenJobs[childJobName] = error;
-                    return true;
-                }
-                return false;
-            };
-
-            for (const std::string childJobName : *named) {
-                auto childJobIter = jobs.find(childJobName);
-                if (childJobIter == jobs.end()) {
-                    if (!globConstituents) {
-                        nix::logger->log(
-                            nix::lvlError,
-                            nix::fmt("aggregate job '%s' references "
-                                     "non-existent job '%s'",
-                                     jobName, childJobName));
-                        brokenJobs[childJobName] = "does not exist";
-                    } else if (!insertMatchingConstituents(childJobName,
-                                                           jobName, isBroken,
-                                                           jobs, results)) {
-                        nix::warn("aggregate job '%s' references constituent "
-                                  "glob pattern '%s' with no matches",
-                                  jobName, childJobName);
-                        brokenJobs[childJobName] =
-                            "constituent glob pattern had no matches";
-                    }
-                } else if (!isBroken(childJobName, childJobIter->second)) {
-                    results.insert(childJobName);
+auto DerivationCache::firstOutput(nix::Store &store,
+                                  const nix::StorePath &drvPath)
+    -> std::string {
+    {
+        const std::lock_guard lock(mutex);
+        auto output = outputs.find(drvPath);
+        if (output != outputs.end()) {
+            counters.hits++;
+            return output->second;
+        }
+        counters.misses++;
+    }
+    // Read without the lock, at worst twice by concurrent aggregates
+    auto name = store.readDerivation(drvPath).outputs.begin()->first;
+    const std::lock_guard lock(mutex);
+    outputs.emplace(drvPath, name);
+    return name;
+}
+
+auto DerivationCache::stats() -> Stats {
+    const std::lock_guard lock(mutex);
+    return counters;
+}
+
+auto sortAggregates(std::vector<AggregateJob> aggregates) -> SortedAggregates {
+    using Node = uint32_t;
+    constexpr Node UNVISITED = UINT32_MAX;
+
+    std::unordered_map<std::string_view, Node> nodes;
+    for (Node node = 0; node < aggregates.size(); node++) {
+        nodes.emplace(aggregates[node].name, node);
+    }
+    std::vector<std::vector<Node>> edges(aggregates.size());
+    for (Node node = 0; node < aggregates.size(); node++) {
+        for (const auto &dependency : aggregates[node].dependencies) {
+            auto target = nodes.find(dependency);
+            if (target != nodes.end() && target->second != node) {
+                edges[node].push_back(target->second);
+            }
+        }
+    }
+
+    SortedAggregates result;
+    std::vector<Node> index(aggregates.size(), UNVISITED);
+    std::vector<Node> lowLink(aggregates.size());
+    std::vector<bool> onStack(aggregates.size());
+    /* Visited nodes whose component is not known yet */
+    std::vector<Node> stack;
+    /* In place of recursion: the nodes being visited, and the next edge to
+       follow from each */
+    std::vector<std::pair<Node, size_t>> path;
+    Node nextIndex = 0;
+
+    auto visit = [&](Node node) -> void {
+        index[node] = lowLink[node] = nextIndex++;
+        stack.push_back(node);
+        onStack[node] = true;
+        path.emplace_back(node, 0);
+    };
+
+    for (Node root = 0; root < aggregates.size(); root++) {
+        if (index[root] != UNVISITED) {
+            continue;
+        }
+        visit(root);
+        while (!path.empty()) {
+            auto &[node, edge] = path.back();
+            if (edge < edges[node].size()) {
+                const auto target = edges[node][edge++];
+                if (index[target] == UNVISITED) {
+                    visit(target);
+                } else if (onStack[target]) {
+                    lowLink[node] = std::min(lowLink[node], index[target]);
                 }
+                continue;
             }
 
-            aggregateJobs.insert(AggregateJob(jobName, results, brokenJobs));
+            const auto done = node;
+            path.pop_back();
+            if (!path.empty()) {
+                auto &parentLowLink = lowLink[path.back().first];
+                parentLowLink = std::min(parentLowLink, lowLink[done]);
+            }
+            if (lowLink[done] != index[done]) {
+                continue;
+            }
+
+            /* `done` is the first node of its component. The components
+               it depends on have been completed before. */
+            if (stack.back() == done) {
+                stack.pop_back();
+                onStack[done] = false;
+                result.sorted.push_back(std::move(aggregates[done]));
+                continue;
+            }
+            DependencyCycle cycle;
+            Node member = 0;
+            do {
+                member = stack.back();
+                stack.pop_back();
+                onStack[member] = false;
+                cycle.aggregates.push_back(aggregates[member].name);
+            } while (member != done);
+            std::ranges::sort(cycle.aggregates);
+            result.cycles.push_back(std::move(cycle));
         }
     }
+    return result;
+}
 
-    try {
-        return topoSort(aggregateJobs);
-    } catch (DependencyCycle &e) {
-        return e;
+auto resolveNamedConstituents(const std::map<std::string, JobRecord> &jobs)
+    -> SortedAggregates {
+    std::vector<AggregateJob> aggregateJobs;
+    for (auto const &[jobName, record] : jobs) {
+        if (!record.aggregate.has_value()) {
+            continue;
+        }
+        const auto &job = *record.aggregate;
+        auto named = job.find("namedConstituents");
+        if (named != job.end() && !named->empty()) {
+            aggregateJobs.push_back(resolveAggregate(jobName, job, jobs));
+        }
     }
+
+    auto resolved = sortAggregates(std::move(aggregateJobs));
+    breakCycleDependents(resolved);
+    return resolved;
 }
 
-void rewriteAggregates(std::map<std::string, nlohmann::json> &jobs,
+void rewriteAggregates(std::map<std::string, JobRecord> &jobs,
                        const std::vector<AggregateJob> &aggregateJobs,
                        const nix::ref<nix::LocalFSStore> &store,
-                       const nix::Path &gcRootsDir) {
-    for (const auto &aggregateJob : aggregateJobs) {
-        auto &job = jobs.find(aggregateJob.name)->second;
-        auto drvPath = store->parseStorePath(std::string(job["drvPath"]));
-        auto drv = store->readDerivation(drvPath);
+                       DerivationCache &derivations,
+                       const nix::Path &gcRootsDir, size_t threads) {
+    /* Each aggregate is rewritten once the aggregates it depends on are,
+       on a single pool. It only reads their records, and writes its own. */
+    std::unordered_map<std::string_view, size_t> indices;
+    for (size_t i = 0; i < aggregateJobs.size(); i++) {
+        indices.emplace(aggregateJobs[i].name, i);
+    }
+    std::vector<size_t> waitingFor(aggregateJobs.size());
+    std::vector<std::vector<size_t>> dependents(aggregateJobs.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < aggregateJobs.size(); i++) {
+        for (const auto &dependency : aggregateJobs[i].dependencies) {
+            auto index = indices.find(dependency);
+            if (index != indices.end()) {
+                waitingFor[i]++;
+                dependents[index->second].push_back(i);
+            }
+        }
+        if (waitingFor[i] == 0) {
+            ready.push_back(i);
+        }
+    }
 
-        if (aggregateJob.brokenJobs.empty()) {
-            addConstituents(job, drv, aggregateJob.dependencies, jobs, store);
-            rewriteDerivation(job, drv, drvPath, store, gcRootsDir);
+    nix::ThreadPool pool(threads);
+    std::mutex mutex;
+    std::function<void(size_t)> rewrite = [&](size_t i) -> void {
+        rewriteAggregate(jobs, aggregateJobs[i], store, derivations,
+                         gcRootsDir);
+        const std::lock_guard lock(mutex);
+        for (const auto dependent : dependents[i]) {
+            if (--waitingFor[dependent] == 0) {
+                pool.enqueue([&rewrite, dependent]() -> void {
+                    rewrite(dependent);
+                });
+            }
         }
+    };
+    for (const auto i : ready) {
+        pool.enqueue([&rewrite, i]() -> void { rewrite(i); });
+    }
+    pool.process();
+
+    // In topological order, however they were scheduled
+    for (const auto &aggregateJob : aggregateJobs) {
+        getCoutLock().lock()
+            << jobs.find(aggregateJob.name)->second.aggregate->dump() << "\n";
+    }
+}
+
+ConstituentResolver::ConstituentResolver(const nix::ref<nix::Store> &store,
+                                         nix::Path gcRootsDir, Emit emit)
+    : store(store.dynamic_pointer_cast<nix::LocalFSStore>()),
+      gcRootsDir(std::move(gcRootsDir)), emit(std::move(emit)),
+      queue([this](std::vector<Submitted> &jobs) -> void {
+          for (auto &[attr, record] : jobs) {
+              add(std::move(attr), std::move(record));
+          }
+      }) {}
+
+void ConstituentResolver::submit(std::string attr, JobRecord record) {
+    queue.push({std::move(attr), std::move(record)});
+}
+
+void ConstituentResolver::finish() { queue.finish(); }
+
+void ConstituentResolver::add(std::string attr, JobRecord record) {
+    const bool isAggregate = record.aggregate.has_value();
+    records.insert_or_assign(attr, std::move(record));
+    if (!store) {
+        return;
+    }
+
+    std::vector<std::string> ready;
+    if (!isAggregate) {
+        arrived(attr, ready);
+    } else if (waitForConstituents(attr)) {
+        ready.push_back(std::move(attr));
+    }
+
+    while (!ready.empty()) {
+        auto name = std::move(ready.back());
+        ready.pop_back();
 
-        job.erase("namedConstituents");
+        rewriteAggregate(
+            records,
+            resolveAggregate(name, records.at(name).aggregate.value(), records),
+            nix::ref<nix::LocalFSStore>(store), derivationCache, gcRootsDir);
+        auto &aggregate = records.at(name).aggregate;
+        emit(aggregate->dump());
+        // A plain job from now on, for the aggregates depending on it
+        aggregate.reset();
 
-        if (!aggregateJob.brokenJobs.empty()) {
-            addBrokenJobsError(job, aggregateJob.brokenJobs);
+        arrived(name, ready);
+    }
+}
+
+auto ConstituentResolver::waitForConstituents(const std::string &attr)
+    -> bool {
+    const auto &job = records.at(attr).aggregate.value();
+    // Glob patterns may match jobs that are evaluated later
+    if (job.value<bool>("globConstituents", false)) {
+        return false;
+    }
+
+    std::set<std::string> constituents;
+    for (const std::string name : job.at("namedConstituents")) {
+        auto record = records.find(name);
+        if (record == records.end() || record->second.aggregate.has_value()) {
+            constituents.insert(name);
+            waiting[name].push_back(attr);
         }
+    }
+    if (constituents.empty()) {
+        return true;
+    }
+    missing.insert_or_assign(attr, std::move(constituents));
+    return false;
+}
 
-        getCoutLock().lock() << job.dump() << "\n";
+/* Adds the aggregates that were only waiting for `attr` to `ready` */
+void ConstituentResolver::arrived(const std::string &attr,
+                                  std::vector<std::string> &ready) {
+    auto waiters = waiting.find(attr);
+    if (waiters == waiting.end()) {
+        return;
+    }
+    for (const auto &aggregate : waiters->second) {
+        auto constituents = missing.find(aggregate);
+        if (constituents != missing.end() &&
+            constituents->second.erase(attr) > 0 &&
+            constituents->second.empty()) {
+            missing.erase(constituents);
+            ready.push_back(aggregate);
+        }
     }
+    waiting.erase(waiters);
 }
@@ -1,50 +1,164 @@
 #pragma once
 
-#include <exception>
+#include <cstddef>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
-#include <variant>
 #include <vector>
 
-#include <nlohmann/json_fwd.hpp>
+// we need this include or otherwise we cannot instantiate std::optional
+#include <nlohmann/json.hpp> //NOLINT(misc-include-cleaner)
 
 #include <nix/util/fmt.hh>
 #include <nix/store/local-fs-store.hh>
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
 #include <nix/util/ref.hh>
+#include <nix/util/strings.hh>
 #include <nix/util/types.hh>
 
-struct DependencyCycle : public std::exception {
-    std::string a;
-    std::string b;
-    std::set<std::string> remainingAggregates;
+#include "background-queue.hh"
 
-    DependencyCycle(std::string nodeA, std::string nodeB,
-                    const std::set<std::string> &remainingAggregates)
-        : a(std::move(nodeA)), b(std::move(nodeB)),
-          remainingAggregates(remainingAggregates) {}
+/* Aggregates that depend on each other, sorted by name */
+struct DependencyCycle {
+    std::vector<std::string> aggregates;
 
     [[nodiscard]] auto message() const -> std::string {
-        return nix::fmt("Dependency cycle: %s <-> %s", a, b);
+        return "Dependency cycle: " +
+               nix::concatStringsSep(" <-> ", aggregates);
     }
 };
 
+/* What --constituents keeps of a job until all jobs are evaluated. Only
+   aggregates, which are written at the end, are kept whole. */
+struct JobRecord {
+    std::string drvPath;
+    /* Set if the job failed to evaluate */
+    std::optional<std::string> error;
+    /* Aggregates: the job with "namedConstituents" */
+    std::optional<nlohmann::json> aggregate;
+};
+
 struct AggregateJob {
     std::string name;
     std::set<std::string> dependencies;
     std::unordered_map<std::string, std::string> brokenJobs;
+};
 
-    auto operator<(const AggregateJob &other) const -> bool {
-        return name < other.name;
-    }
+struct SortedAggregates {
+    /* Aggregates after the aggregates they depend on */
+    std::vector<AggregateJob> sorted;
+    /* Left out of `sorted`. sortAggregates() sorts the aggregates depending
+       on a cycle as if it did not exist. */
+    std::vector<DependencyCycle> cycles;
 };
 
-auto resolveNamedConstituents(const std::map<std::string, nlohmann::json> &jobs)
-    -> std::variant<std::vector<AggregateJob>, DependencyCycle>;
+/* The output names of constituents, for all aggregates of a run. Many
+   aggregates share constituents, whose .drv files are then read once. The
+   derivation hashes of constituents are already memoized by Nix itself.
+   Safe to use from several threads. */
+class DerivationCache {
+  public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+    };
 
-void rewriteAggregates(std::map<std::string, nlohmann::json> &jobs,
+    /* The output an aggregate depends on */
+    auto firstOutput(nix::Store &store, const nix::StorePath &drvPath)
+        -> std::string;
+
+    [[nodiscard]] auto stats() -> Stats;
+
+  private:
+    std::mutex mutex;
+    std::map<nix::StorePath, std::string> outputs;
+    Stats counters;
+};
+
+/* Sorts the aggregates by their dependencies in linear time, with
+   Tarjan's algorithm on an explicit stack, so long chains of aggregates do
+   not overflow the call stack. Dependencies that are not in `aggregates`
+   are ignored, and so are aggregates depending on themselves. The result
+   only depends on the order of `aggregates`. */
+auto sortAggregates(std::vector<AggregateJob> aggregates) -> SortedAggregates;
+
+/* Aggregates depending on a cycle, directly or not, get the aggregates
+   they depend on through it as broken jobs */
+auto resolveNamedConstituents(const std::map<std::string, JobRecord> &jobs)
+    -> SortedAggregates;
+
+/* Rewrites the aggregates that do not depend on each other in parallel, on
+   up to `threads` threads (one per core if 0), and prints them in the order
+   of `aggregateJobs` */
+void rewriteAggregates(std::map<std::string, JobRecord> &jobs,
                        const std::vector<AggregateJob> &aggregateJobs,
                        const nix::ref<nix::LocalFSStore> &store,
-                       const nix::Path &gcRootsDir);
+                       DerivationCache &derivations,
+                       const nix::Path &gcRootsDir, size_t threads = 0);
+
+/* Rewrites and emits aggregates while the jobs are still being evaluated,
+   on a thread of its own.
+
+   An aggregate is written as soon as all of its named constituents have
+   arrived, and those that are aggregates themselves have been written. The
+   others are left to resolveNamedConstituents() and rewriteAggregates()
+   once all jobs are known: aggregates with glob constituents, which may
+   match jobs evaluated later, those naming jobs that do not exist, those in
+   a dependency cycle, and those depending on any of these. Without a local
+   store, nothing is written before the end. */
+class ConstituentResolver {
+  public:
+    using Emit = std::function<void(std::string_view payload)>;
+
+    ConstituentResolver(const nix::ref<nix::Store> &store,
+                        nix::Path gcRootsDir, Emit emit);
+
+    /* Rethrows the error that stopped the thread, if any */
+    void submit(std::string attr, JobRecord record);
+
+    /* Handles the jobs submitted so far and stops the thread. Rethrows the
+       error that stopped it, if any. */
+    void finish();
+
+    /* Only complete after finish(). Aggregates that have been emitted no
+       longer have `aggregate` set. */
+    [[nodiscard]] auto jobs() -> std::map<std::string, JobRecord> & {
+        return records;
+    }
+
+    /* For the aggregates that are rewritten after finish() as well */
+    [[nodiscard]] auto derivations() -> DerivationCache & {
+        return derivationCache;
+    }
+
+  private:
+    using Submitted = std::pair<std::string, JobRecord>;
+
+    std::shared_ptr<nix::LocalFSStore> store;
+    nix::Path gcRootsDir;
+    Emit emit;
+
+    DerivationCache derivationCache;
+
+    /* Only touched by the thread */
+    std::map<std::string, JobRecord> records;
+    /* Constituents each waiting aggregate is missing */
+    std::map<std::string, std::set<std::string>> missing;
+    /* Aggregates waiting for each missing constituent */
+    std::map<std::string, std::vector<std::string>> waiting;
+
+    /* Last, its thread uses the members above */
+    BackgroundQueue<Submitted> queue;
+
+    void add(std::string attr, JobRecord record);
+    [[nodiscard]] auto waitForConstituents(const std::string &attr) -> bool;
+    void arrived(const std::string &attr, std::vector<std::string> &ready);
+};
@@ -1,4 +1,3 @@
-#include <nix/store/path-with-outputs.hh>
 #include <nix/store/store-api.hh>
 #include <nix/store/local-fs-store.hh>
 #include <nix/store/globals.hh>
@@ -8,6 +7,7 @@
 #include <nix/expr/get-drvs.hh>
 #include <nix/store/derived-path-map.hh>
 #include <nix/expr/eval.hh>
+#include <nix/expr/eval-cache.hh>
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 #include <nix/store/path.hh>
@@ -25,11 +25,9 @@
 #include <map>
 #include <optional>
 #include <set>
-#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
-#include <algorithm>
 
 #include "drv.hh"
 #include "eval-args.hh"
@@ -75,12 +73,16 @@ auto queryOutputs(nix::PackageInfo &packageInfo, nix::EvalState &state,
     return outputs;
 }
 
-auto queryMeta(nix::PackageInfo &packageInfo, nix::EvalState &state)
+/* Only the attributes in `fields` are evaluated, unless it is empty */
+auto queryMeta(nix::PackageInfo &packageInfo, nix::EvalState &state,
+               const std::set<std::string> &fields)
     -> std::optional<nlohmann::json> {
     nlohmann::json meta_;
     for (const auto &metaName : packageInfo.queryMetaNames()) {
+        if (!fields.empty() && !fields.contains(metaName)) {
+            continue;
+        }
         nix::NixStringContext context;
-        std::stringstream stream;
 
         auto *metaValue = packageInfo.queryMeta(metaName);
         // Skip non-serialisable types
@@ -88,10 +90,9 @@ auto queryMeta(nix::PackageInfo &packageInfo, nix::EvalState &state)
             continue;
         }
 
-        nix::printValueAsJSON(state, true, *metaValue, nix::noPos, stream,
-                              context);
-
-        meta_[metaName] = nlohmann::json::parse(stream.str());
+        // Straight into the json tree, without printing and parsing it
+        meta_[metaName] = nix::printValueAsJSON(state, true, *metaValue,
+                                                nix::noPos, context);
     }
     return meta_;
 }
@@ -109,78 +110,22 @@ auto queryInputDrvs(const nix::Derivation &drv, nix::Store &store)
     return drvs;
 }
 
-auto queryCacheStatus(
-    nix::Store &store,
-    std::map<std::string, std::optional<std::string>> &outputs,
-    std::vector<std::string> &neededBuilds,
-    std::vector<std::string> &neededSubstitutes,
-    std::vector<std::string> &unknownPaths, const nix::Derivation &drv)
-    -> Drv::CacheStatus {
-
-    std::vector<nix::StorePathWithOutputs> paths;
-    // Add output paths
-    for (auto const &[key, val] : outputs) {
-        if (val) {
-            paths.push_back(followLinksToStorePathWithOutputs(store, *val));
-        }
-    }
-
-    // Add input derivation paths
-    for (const auto &[inputDrvPath, inputNode] : drv.inputDrvs.map) {
-        paths.push_back(
-            nix::StorePathWithOutputs(inputDrvPath, inputNode.value));
-    }
-
-    auto missing = store.queryMissing(toDerivedPaths(paths));
-
-    if (!missing.willBuild.empty()) {
-        // TODO: can we expose the topological sort order as a graph?
-        auto sorted = store.topoSortPaths(missing.willBuild);
-        std::ranges::reverse(sorted.begin(), sorted.end());
-        for (auto &path : sorted) {
-            neededBuilds.push_back(store.printStorePath(path));
-        }
-    }
-    if (!missing.willSubstitute.empty()) {
-        std::vector<const nix::StorePath *> willSubstituteSorted = {};
-        std::ranges::for_each(missing.willSubstitute.begin(),
-                              missing.willSubstitute.end(),
-                              [&](const nix::StorePath &path) -> void {
-                                  willSubstituteSorted.push_back(&path);
-                              });
-        std::ranges::sort(
-            willSubstituteSorted.begin(), willSubstituteSorted.end(),
-            [](const nix::StorePath *lhs, const nix::StorePath *rhs) -> bool {
-                if (lhs->name() == rhs->name()) {
-                    return lhs->to_string() < rhs->to_string();
-                }
-                return lhs->name() < rhs->name();
-            });
-        for (const auto *path : willSubstituteSorted) {
-            neededSubstitutes.push_back(store.printStorePath(*path));
-        }
-    }
+/* The fields that are only known precisely from the .drv file */
+void readDerivationFields(Drv &drv, nix::Store &store,
+                          const nix::Derivation &derivation,
+                          const MyArgs &args) {
+    // Use the more precise system from the derivation
+    drv.system = derivation.platform;
 
-    if (!missing.unknown.empty()) {
-        for (const auto &path : missing.unknown) {
-            unknownPaths.push_back(store.printStorePath(path));
-        }
+    if (args.showInputDrvs) {
+        drv.inputDrvs = queryInputDrvs(derivation, store);
     }
 
-    if (missing.willBuild.empty() && missing.unknown.empty()) {
-        if (missing.willSubstitute.empty()) {
-            // cacheStatus is Local if:
-            //  - there's nothing to build
-            //  - there's nothing to substitute
-            return Drv::CacheStatus::Local;
-        }
-        // cacheStatus is Cached if:
-        //  - there's nothing to build
-        //  - there are paths to substitute
-        return Drv::CacheStatus::Cached;
-    }
-    return Drv::CacheStatus::NotBuilt;
-};
+    auto drvOptions = derivationOptionsFromStructuredAttrs(
+        store, derivation.env, get(derivation.structuredAttrs));
+    drv.requiredSystemFeatures =
+        std::optional(drvOptions.getRequiredSystemFeatures(derivation));
+}
 
 } // namespace
 
@@ -204,40 +149,52 @@ Drv::Drv(std::string &attrPath, nix::EvalState &state,
     if (canReadDerivation) {
         // We can read the derivation directly for precise information
         auto drv = localStore->readDerivation(packageInfo.requireDrvPath());
-
-        // Use the more precise system from the derivation
-        system = drv.platform;
-
-        if (args.checkCacheStatus) {
-            // TODO: is this a bottleneck, where we should batch these queries?
-            cacheStatus =
-                queryCacheStatus(*store, outputs, neededBuilds,
-                                 neededSubstitutes, unknownPaths, drv);
-        } else {
-            cacheStatus = Drv::CacheStatus::Unknown;
-        }
-
-        if (args.showInputDrvs) {
-            inputDrvs = queryInputDrvs(drv, *store);
-        }
-
-        auto drvOptions = derivationOptionsFromStructuredAttrs(
-            *store, drv.env, get(drv.structuredAttrs));
-        requiredSystemFeatures =
-            std::optional(drvOptions.getRequiredSystemFeatures(drv));
+        readDerivationFields(*this, *store, drv, args);
     } else {
         // Fall back to basic info from PackageInfo
         // This happens when:
         // - In read-only/no-instantiate mode
         // - Store is not a LocalFSStore (e.g., remote store)
         system = packageInfo.querySystem();
-        cacheStatus = Drv::CacheStatus::Unknown;
         // Can't get input derivations without reading the .drv file
     }
 
     // Handle metadata (works in both modes)
     if (args.meta) {
-        meta = queryMeta(packageInfo, state);
+        meta = queryMeta(packageInfo, state, args.metaFields);
+    }
+}
+
+Drv::Drv(nix::EvalState &state, nix::eval_cache::AttrCursor &cursor,
+         MyArgs &args)
+    : name(cursor.getAttr("name")->getString()) {
+
+    auto store = state.store;
+
+    // Evaluates drvPath again if the derivation was garbage collected
+    const auto storePath = cursor.forceDerivation();
+    drvPath = store->printStorePath(storePath);
+
+    auto localStore = store.dynamic_pointer_cast<nix::LocalFSStore>();
+    const bool canReadDerivation = localStore && !nix::settings.readOnlyMode;
+
+    if (canReadDerivation) {
+        auto drv = localStore->readDerivation(storePath);
+        for (const auto &[outputName, output] :
+             drv.outputsAndOptPaths(*store)) {
+            outputs[outputName] =
+                output.second
+                    ? std::optional(store->printStorePath(*output.second))
+                    : std::nullopt;
+        }
+        readDerivationFields(*this, *store, drv, args);
+    } else {
+        system = cursor.getAttr("system")->getString();
+        for (const auto &outputName :
+             cursor.getAttr("outputs")->getListOfStrings()) {
+            outputs[outputName] =
+                cursor.getAttr(outputName)->getAttr("outPath")->getString();
+        }
     }
 }
 
@@ -263,26 +220,4 @@ void to_json(nlohmann::json &json, const Drv &drv) {
         json["namedConstituents"] = constituents->namedConstituents;
         json["globConstituents"] = constituents->globConstituents;
     }
-
-    if (drv.cacheStatus != Drv::CacheStatus::Unknown) {
-        // Deprecated field
-        json["isCached"] = drv.cacheStatus == Drv::CacheStatus::Cached ||
-                           drv.cacheStatus == Drv::CacheStatus::Local;
-
-        switch (drv.cacheStatus) {
-        case Drv::CacheStatus::Cached:
-            json["cacheStatus"] = "cached";
-            break;
-        case Drv::CacheStatus::Local:
-            json["cacheStatus"] = "local";
-            break;
-        default:
-            json["cacheStatus"] = "notBuilt";
-            break;
-        }
-        json["neededBuilds"] = drv.neededBuilds;
-        json["neededSubstitutes"] = drv.neededSubstitutes;
-        // TODO: is it useful to include "unknown" paths at all?
-        // json["unknown"] = drv.unknownPaths;
-    }
 }
@@ -4,7 +4,6 @@
 #include <nlohmann/json_fwd.hpp>
 // we need this include or otherwise we cannot instantiate std::optional
 #include <nlohmann/json.hpp> //NOLINT(misc-include-cleaner)
-#include <cstdint>
 #include <map>
 #include <optional>
 #include <set>
@@ -19,6 +18,10 @@ class EvalState;
 struct PackageInfo;
 } // namespace nix
 
+namespace nix::eval_cache {
+class AttrCursor;
+} // namespace nix::eval_cache
+
 struct Constituents {
     std::vector<std::string> constituents;
     std::vector<std::string> namedConstituents;
@@ -36,6 +39,11 @@ struct Drv {
     Drv(std::string &attrPath, nix::EvalState &state,
         nix::PackageInfo &packageInfo, MyArgs &args,
         std::optional<Constituents> constituents);
+    /* From an eval cache cursor, forcing as little as possible: the
+       attributes read from the cursor are cached across runs, the rest
+       comes from the .drv file. Does not support meta and constituents. */
+    Drv(nix::EvalState &state, nix::eval_cache::AttrCursor &cursor,
+        MyArgs &args);
     std::string name;
     std::string system;
     std::string drvPath;
@@ -47,20 +55,6 @@ struct Drv {
 
     std::optional<nix::StringSet> requiredSystemFeatures = std::nullopt;
 
-    // TODO: can we lazily allocate these?
-    std::vector<std::string> neededBuilds;
-    std::vector<std::string> neededSubstitutes;
-    std::vector<std::string> unknownPaths;
-
-    // TODO: we might not need to store this as it can be computed from the
-    // above
-    enum class CacheStatus : uint8_t {
-        Local,
-        Cached,
-        NotBuilt,
-        Unknown
-    } cacheStatus = CacheStatus::Unknown;
-
     std::optional<nlohmann::json> meta = std::nullopt;
     std::optional<Constituents> constituents = std::nullopt;
 };
@@ -1,6 +1,7 @@
 
 #include <cstdlib>
 #include <nix/util/args.hh>
+#include <nix/util/error.hh>
 #include <nix/util/file-system.hh>
 #include <nix/flake/flake.hh>
 #include <nix/flake/lockfile.hh>
@@ -8,12 +9,17 @@
 #include <nix/main/common-args.hh>
 #include <nix/cmd/common-eval-args.hh>
 #include <nix/util/source-accessor.hh>
+#include <nix/util/strings.hh>
 #include <nix/flake/flakeref.hh>
+#include <algorithm>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <set>
 #include <string>
+#include <functional>
 
 #include "eval-args.hh"
 #include "output-stream-lock.hh"
@@ -57,6 +63,35 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
+    addSchedulingFlag({
+        .longName = "result-cache",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "SQLite database with the jobs of previous runs. Jobs of an "
+            "unchanged locked flake are reused instead of evaluated",
+        .category = "",
+        .labels = {"path"},
+        .handler = {&resultCacheFile},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "eval-cache",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "walk a locked flake through Nix's evaluation cache, so that "
+            "attribute names and derivation paths of unchanged attributes are "
+            "not evaluated again. Every worker uses a database of its own",
+        .category = "",
+        .labels = {},
+        .handler = {&evalCache, true},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
     addFlag({
         .longName = "force-recurse",
         .aliases = {},
@@ -69,7 +104,7 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
-    addFlag({
+    addSchedulingFlag({
         .longName = "gc-roots-dir",
         .aliases = {},
         .shortName = 0,
@@ -81,7 +116,22 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
-    addFlag({
+    addSchedulingFlag({
+        .longName = "history-file",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "file with the evaluation time of every attribute from the "
+            "previous run. Expensive subtrees are evaluated first, and the "
+            "file is updated when the run succeeds",
+        .category = "",
+        .labels = {"path"},
+        .handler = {&historyFile},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
         .longName = "workers",
         .aliases = {},
         .shortName = 0,
@@ -95,7 +145,56 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
-    addFlag({
+    addSchedulingFlag({
+        .longName = "min-workers",
+        .aliases = {},
+        .shortName = 0,
+        .description = "with --max-workers, the number of workers to start "
+                       "with and to keep at least (1 by default)",
+        .category = "",
+        .labels = {"workers"},
+        .handler = {[this](const std::string &str) -> void {
+            minWorkers = std::max(std::stoi(str), 1);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "max-workers",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "scale the number of workers between --min-workers and this "
+            "count at runtime, based on pending attributes and "
+            "--memory-budget. Overrides --workers",
+        .category = "",
+        .labels = {"workers"},
+        .handler = {[this](const std::string &str) -> void {
+            maxWorkers = std::stoi(str);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "memory-budget",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "with --max-workers, total memory of all workers in megabyte "
+            "that is not exceeded by adding workers (--max-workers times "
+            "--max-memory-size by default)",
+        .category = "",
+        .labels = {"size"},
+        .handler = {[this](const std::string &str) -> void {
+            memoryBudget = std::stoi(str);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
         .longName = "max-memory-size",
         .aliases = {},
         .shortName = 0,
@@ -110,6 +209,63 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
+    addSchedulingFlag({
+        .longName = "respawn-threshold",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "percentage of --max-memory-size at which a replacement worker "
+            "is started in the background, so it is ready when the current "
+            "worker restarts (80 by default, 100 disables)",
+        .category = "",
+        .labels = {"percent"},
+        .handler = {[this](const std::string &str) -> void {
+            respawnThreshold =
+                std::min(static_cast<size_t>(std::max(std::stoi(str), 0)),
+                         MAX_RESPAWN_THRESHOLD);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "max-batch-size",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "maximum number of attributes sent to a worker at once. Batches "
+            "are sized by the observed evaluation time per attribute "
+            "(1, i.e. no batching, by default)",
+        .category = "",
+        .labels = {"size"},
+        .handler = {[this](const std::string &str) -> void {
+            maxBatchSize = std::max(std::stoi(str), 1);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "output-backpressure",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "what to do when stdout is read slower than jobs are evaluated: "
+            "'block' evaluation until it catches up (default) or 'spill' "
+            "the jobs to a temporary file",
+        .category = "",
+        .labels = {"mode"},
+        .handler = {[this](const std::string &str) -> void {
+            if (str != "block" && str != "spill") {
+                throw nix::UsageError(
+                    "--output-backpressure must be 'block' or 'spill'");
+            }
+            spillOutput = str == "spill";
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
     addFlag({
         .longName = "flake",
         .aliases = {},
@@ -134,6 +290,23 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
+    addFlag({
+        .longName = "meta-fields",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "comma-separated meta attributes to include in the output. "
+            "Other attributes are not evaluated. Implies --meta",
+        .category = "",
+        .labels = {"fields"},
+        .handler = {[this](const std::string &str) -> void {
+            meta = true;
+            metaFields = nix::tokenizeString<std::set<std::string>>(str, ",");
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
     addFlag({
         .longName = "constituents",
         .aliases = {},
@@ -201,6 +374,33 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
+    addSchedulingFlag({
+        .longName = "show-stats",
+        .aliases = {},
+        .shortName = 0,
+        .description = "print evaluation statistics as JSON to stderr when "
+                       "done",
+        .category = "",
+        .labels = {},
+        .handler = {&showStats, true},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
+    addSchedulingFlag({
+        .longName = "zygote",
+        .aliases = {},
+        .shortName = 0,
+        .description = "fork workers from a process that has already "
+                       "evaluated the root, instead of evaluating it in every "
+                       "worker (Linux only)",
+        .category = "",
+        .labels = {},
+        .handler = {&zygote, true},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
     addFlag({
         .longName = "expr",
         .aliases = {},
@@ -228,6 +428,28 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
         .experimentalFeature = std::nullopt,
     });
 
+    addFlag({
+        .longName = "apply-named",
+        .aliases = {},
+        .shortName = 0,
+        .description =
+            "Like --apply, but the result of the function is stored under "
+            "the given name inside `\"extraValue\"`. May be given multiple "
+            "times, and together with --apply.",
+        .category = "",
+        .labels = {"name=expr"},
+        .handler = {[this](const std::string &str) -> void {
+            const auto eq = str.find('=');
+            if (eq == std::string::npos || eq == 0) {
+                throw nix::UsageError(
+                    "--apply-named expects 'name=expr', got '%s'", str);
+            }
+            applyNamedExprs[str.substr(0, eq)] = str.substr(eq + 1);
+        }},
+        .completer = nullptr,
+        .experimentalFeature = std::nullopt,
+    });
+
     addFlag({
         .longName = "select",
         .aliases = {},
@@ -294,5 +516,30 @@ MyArgs::MyArgs() : MixCommonArgs("nix-eval-jobs") {
 }
 
 void MyArgs::parseArgs(char **argv, int argc) {
-    parseCmdline(nix::argvToStrings(argc, argv), false);
+    auto args = nix::argvToStrings(argc, argv);
+    cmdline.assign(std::next(args.begin()), args.end());
+    parseCmdline(args, false);
+}
+
+void MyArgs::addSchedulingFlag(Flag &&flag) {
+    schedulingFlags.emplace("--" + flag.longName, flag.handler.arity);
+    addFlag(std::move(flag));
+}
+
+auto MyArgs::resultCacheKey() const -> std::string {
+    std::string key;
+    for (auto arg = cmdline.begin(); arg != cmdline.end(); ++arg) {
+        auto flag = schedulingFlags.find(*arg);
+        if (flag != schedulingFlags.end()) {
+            // Skip its arguments too
+            for (size_t i = 0;
+                 i < flag->second && std::next(arg) != cmdline.end(); i++) {
+                ++arg;
+            }
+            continue;
+        }
+        key += *arg;
+        key += '\0';
+    }
+    return key;
 }
@@ -4,24 +4,35 @@
 #include <nix/util/args/root.hh>
 #include <nix/cmd/common-eval-args.hh>
 #include <cstddef>
+#include <map>
 #include <nix/main/common-args.hh>
 #include <nix/util/types.hh>
+#include <set>
 #include <string>
+#include <vector>
 
 class MyArgs : virtual public nix::MixEvalArgs,
                virtual public nix::MixCommonArgs,
                virtual public nix::RootArgs {
   public:
     static constexpr size_t DEFAULT_MAX_MEMORY_SIZE = 4096;
+    static constexpr size_t DEFAULT_RESPAWN_THRESHOLD = 80;
+    static constexpr size_t MAX_RESPAWN_THRESHOLD = 100;
 
     virtual ~MyArgs() = default;
     std::string releaseExpr;
     std::string applyExpr;
+    /* --apply-named, by name */
+    std::map<std::string, std::string> applyNamedExprs;
     std::string selectExpr;
     nix::Path gcRootsDir;
+    nix::Path historyFile;
+    nix::Path resultCacheFile;
     bool flake = false;
     bool fromArgs = false;
     bool meta = false;
+    /* --meta-fields, all of them if empty */
+    std::set<std::string> metaFields;
     bool showTrace = false;
     bool impure = false;
     bool forceRecurse = false;
@@ -29,8 +40,20 @@ class MyArgs : virtual public nix::MixEvalArgs,
     bool showInputDrvs = false;
     bool constituents = false;
     bool noInstantiate = false;
+    bool zygote = false;
+    bool showStats = false;
+    bool evalCache = false;
+    /* --output-backpressure spill */
+    bool spillOutput = false;
     size_t nrWorkers = 1;
+    /* Autoscaling is enabled by maxWorkers > 0 */
+    size_t minWorkers = 1;
+    size_t maxWorkers = 0;
+    /* 0 means maxWorkers * maxMemorySize */
+    size_t memoryBudget = 0;
     size_t maxMemorySize = DEFAULT_MAX_MEMORY_SIZE;
+    size_t respawnThreshold = DEFAULT_RESPAWN_THRESHOLD;
+    size_t maxBatchSize = 1;
 
     // usually in MixFlakeOptions
     nix::flake::LockFlags lockFlags = {.updateLockFile = false,
@@ -48,4 +71,18 @@ class MyArgs : virtual public nix::MixEvalArgs,
     MyArgs(const MyArgs &) = delete;
 
     void parseArgs(char **argv, int argc);
+
+    /* The command line without options that only affect scheduling, to key
+       --result-cache entries. Evaluation options like --arg are only
+       accessible as part of the command line. */
+    [[nodiscard]] auto resultCacheKey() const -> std::string;
+
+  private:
+    std::vector<std::string> cmdline;
+    /* The options left out of resultCacheKey(), with their number of
+       arguments */
+    std::map<std::string, size_t> schedulingFlags;
+
+    /* addFlag() for options that only affect scheduling */
+    void addSchedulingFlag(Flag &&flag);
 };
@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <ranges>
+#include <string>
+#include <utility>
+#include <vector>
+#include <nix/util/error.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/logging.hh>
+#include <nlohmann/json.hpp>
+
+#include "history.hh"
+
+namespace {
+constexpr int HISTORY_VERSION = 1;
+} // namespace
+
+void History::load(const std::string &path) {
+    if (!nix::pathExists(path)) {
+        return;
+    }
+
+    nlohmann::json json;
+    try {
+        json = nlohmann::json::parse(nix::readFile(path));
+        if (json.at("version").get<int>() != HISTORY_VERSION) {
+            nix::warn("ignoring history file '%s' of unsupported version",
+                      path);
+            return;
+        }
+        for (const auto &entry : json.at("attrs")) {
+            const auto seconds = entry.at("seconds").get<double>();
+            // A subtree costs its own evaluation plus all of its descendants
+            for (auto id = attrPaths.intern(entry.at("attrPath"));;
+                 id = attrPaths.parent(id)) {
+                subtreeSeconds[id] += seconds;
+                if (id == AttrPathTable::ROOT) {
+                    break;
+                }
+            }
+        }
+    } catch (const nlohmann::json::exception &e) {
+        subtreeSeconds.clear();
+        nix::warn("ignoring invalid history file '%s': %s", path, e.what());
+    }
+}
+
+void History::save(const std::string &path) {
+    // Sorted for stable diffs between runs
+    std::map<std::string, nlohmann::json> sorted;
+    {
+        auto entries(recorded.lock());
+        for (const auto &[id, entry] : *entries) {
+            sorted.emplace(attrPaths.dotted(id),
+                           nlohmann::json{
+                               {"attrPath", attrPaths.toJson(id)},
+                               {"seconds", entry.seconds},
+                               {"children", entry.children},
+                               {"rssDeltaKiB", entry.rssDeltaKiB},
+                           });
+        }
+    }
+
+    auto attrs = nlohmann::json::array();
+    for (auto &entry : sorted | std::views::values) {
+        attrs.push_back(std::move(entry));
+    }
+    const nlohmann::json json{{"version", HISTORY_VERSION},
+                              {"attrs", std::move(attrs)}};
+
+    const auto tmpPath = path + ".tmp";
+    nix::writeFile(tmpPath, json.dump() + "\n");
+    if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+        throw nix::SysError("renaming '%s' to '%s'", tmpPath, path);
+    }
+}
+
+void History::record(AttrPathId path, const Entry &entry) {
+    recorded.lock()->insert_or_assign(path, entry);
+}
+
+void History::orderChildren(std::vector<AttrPathId> &children) const {
+    if (subtreeSeconds.empty() || children.size() < 2) {
+        return;
+    }
+
+    double knownSeconds = 0;
+    size_t known = 0;
+    for (const auto child : children) {
+        auto cost = subtreeSeconds.find(child);
+        if (cost != subtreeSeconds.end()) {
+            knownSeconds += cost->second;
+            known++;
+        }
+    }
+    if (known == 0) {
+        return;
+    }
+    // New attributes are assumed to be as expensive as their siblings
+    const double unknownSeconds = knownSeconds / static_cast<double>(known);
+
+    std::vector<std::pair<double, AttrPathId>> costs;
+    costs.reserve(children.size());
+    for (const auto child : children) {
+        auto cost = subtreeSeconds.find(child);
+        costs.emplace_back(
+            cost != subtreeSeconds.end() ? cost->second : unknownSeconds,
+            child);
+    }
+    std::ranges::stable_sort(costs, std::ranges::greater{},
+                             &std::pair<double, AttrPathId>::first);
+
+    /* The collector owning the children pops the first one next, idle
+       collectors steal from the other end. Hand the most expensive subtree
+       to the owner and the next most expensive ones to the thieves. */
+    children.clear();
+    children.push_back(costs.front().second);
+    for (const auto &cost : std::ranges::reverse_view(costs) |
+                                std::views::take(costs.size() - 1)) {
+        children.push_back(cost.second);
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nix/util/sync.hh>
+
+#include "attr-path-table.hh"
+
+/* Evaluation costs per attribute path, kept across runs in --history-file.
+
+   Costs of the previous run are used to queue the children of an attribute
+   set by the estimated cost of their whole subtree, so that expensive
+   subtrees are started first instead of in lexicographic order
+   (longest-processing-time-first). The costs measured in this run replace
+   the file when the run succeeds. */
+class History {
+  public:
+    struct Entry {
+        /* Time spent evaluating the attribute itself, not its children */
+        double seconds = 0;
+        uint32_t children = 0;
+        /* Growth of the worker's peak RSS while evaluating the attribute */
+        uint32_t rssDeltaKiB = 0;
+    };
+
+    explicit History(AttrPathTable &attrPaths) : attrPaths(attrPaths) {}
+
+    /* A missing file is treated as an empty history. */
+    void load(const std::string &path);
+    /* Writes the costs recorded in this run, atomically replacing `path`. */
+    void save(const std::string &path);
+
+    void record(AttrPathId path, const Entry &entry);
+
+    /* Reorders `children` by the subtree cost of the previous run, keeping
+       the lexicographic order if none of them has been seen before. */
+    void orderChildren(std::vector<AttrPathId> &children) const;
+
+  private:
+    AttrPathTable &attrPaths;
+    /* Read-only after load() */
+    std::unordered_map<AttrPathId, double> subtreeSeconds;
+    nix::Sync<std::unordered_map<AttrPathId, Entry>> recorded;
+};
@@ -0,0 +1,147 @@
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <nix/util/error.hh>
+#include <nlohmann/json.hpp>
+
+#include "json-fields.hh"
+
+namespace {
+
+[[noreturn]] void invalid(std::string_view json, size_t pos) {
+    throw nix::Error("invalid JSON object: unexpected %s at offset %d",
+                     pos < json.size() ? "'" + std::string(1, json[pos]) + "'"
+                                       : std::string("end"),
+                     pos);
+}
+
+auto skipWhitespace(std::string_view json, size_t pos) -> size_t {
+    while (pos < json.size() && (json[pos] == ' ' || json[pos] == '\n' ||
+                                 json[pos] == '\r' || json[pos] == '\t')) {
+        pos++;
+    }
+    return pos;
+}
+
+/* `pos` is at the opening quote, returns the position after the closing
+   one */
+auto skipString(std::string_view json, size_t pos) -> size_t {
+    for (pos++; pos < json.size(); pos++) {
+        if (json[pos] == '"') {
+            return pos + 1;
+        }
+        if (json[pos] == '\\') {
+            pos++;
+        }
+    }
+    invalid(json, json.size());
+}
+
+auto skipValue(std::string_view json, size_t pos) -> size_t {
+    if (pos >= json.size()) {
+        invalid(json, pos);
+    }
+    switch (json[pos]) {
+    case '"':
+        return skipString(json, pos);
+    case '{':
+    case '[': {
+        size_t depth = 0;
+        while (pos < json.size()) {
+            switch (json[pos]) {
+            case '"':
+                pos = skipString(json, pos);
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0) {
+                    return pos + 1;
+                }
+                break;
+            default:
+                break;
+            }
+            pos++;
+        }
+        invalid(json, json.size());
+    }
+    default: {
+        // Numbers, true, false and null
+        auto end = json.find_first_of(",}] \n\r\t", pos);
+        if (end == pos) {
+            invalid(json, pos);
+        }
+        return end == std::string_view::npos ? json.size() : end;
+    }
+    }
+}
+
+} // namespace
+
+JsonFields::JsonFields(std::string_view json) {
+    auto pos = skipWhitespace(json, 0);
+    if (pos >= json.size() || json[pos] != '{') {
+        invalid(json, pos);
+    }
+    pos = skipWhitespace(json, pos + 1);
+    if (pos < json.size() && json[pos] == '}') {
+        return;
+    }
+    while (true) {
+        if (pos >= json.size() || json[pos] != '"') {
+            invalid(json, pos);
+        }
+        const auto keyEnd = skipString(json, pos);
+        auto key = json.substr(pos + 1, keyEnd - pos - 2);
+        std::string decoded;
+        if (key.find('\\') == std::string_view::npos) {
+            decoded = key;
+        } else {
+            decoded = nlohmann::json::parse(json.substr(pos, keyEnd - pos))
+                          .get<std::string>();
+        }
+
+        pos = skipWhitespace(json, keyEnd);
+        if (pos >= json.size() || json[pos] != ':') {
+            invalid(json, pos);
+        }
+        const auto valueStart = skipWhitespace(json, pos + 1);
+        const auto valueEnd = skipValue(json, valueStart);
+        fields.emplace_back(std::move(decoded),
+                            json.substr(valueStart, valueEnd - valueStart));
+
+        pos = skipWhitespace(json, valueEnd);
+        if (pos < json.size() && json[pos] == ',') {
+            pos = skipWhitespace(json, pos + 1);
+            continue;
+        }
+        if (pos < json.size() && json[pos] == '}') {
+            return;
+        }
+        invalid(json, pos);
+    }
+}
+
+auto JsonFields::raw(std::string_view key) const
+    -> std::optional<std::string_view> {
+    for (const auto &[name, value] : fields) {
+        if (name == key) {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+auto JsonFields::get(std::string_view key) const
+    -> std::optional<nlohmann::json> {
+    auto value = raw(key);
+    if (!value.has_value()) {
+        return std::nullopt;
+    }
+    return nlohmann::json::parse(*value);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+/* The top-level fields of a JSON object, located without parsing their
+   values.
+
+   The main process only needs a few small fields of a job, such as "attr"
+   or "drvPath", while "meta" or "extraValue" can be large. Values are kept
+   as slices of the original text, which must outlive this object, and are
+   only parsed when asked for. */
+class JsonFields {
+  public:
+    /* Throws nix::Error if `json` is not a JSON object */
+    explicit JsonFields(std::string_view json);
+
+    /* The JSON text of the value of `key` */
+    [[nodiscard]] auto raw(std::string_view key) const
+        -> std::optional<std::string_view>;
+
+    [[nodiscard]] auto get(std::string_view key) const
+        -> std::optional<nlohmann::json>;
+
+    [[nodiscard]] auto contains(std::string_view key) const -> bool {
+        return raw(key).has_value();
+    }
+
+  private:
+    std::vector<std::pair<std::string, std::string_view>> fields;
+};
@@ -4,9 +4,13 @@
 #include <stdlib.h>
 #include <string.h>
 // NOLINTEND(modernize-deprecated-headers)
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
-#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
@@ -14,6 +18,8 @@
 #include <exception>
 #include <filesystem>
 #include <functional>
+#include <iostream>
+#include <iterator>
 #include <map>
 #include <memory>
 #include <nix/cmd/common-eval-args.hh>
@@ -32,22 +38,23 @@
 #include <nix/util/processes.hh>
 #include <nix/main/shared.hh>
 #include <nix/util/signals.hh> // NOLINT(misc-header-include-cycle)
+#include <nix/util/strings.hh>
 #include <nix/util/sync.hh>
 #include <nix/util/terminal.hh>
 #include <nix/util/util.hh>
 #include <sys/signal.h>
-#include <variant>
 #include <nlohmann/detail/iterators/iter_impl.hpp>
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 #include <optional>
 #include <pthread.h>
-#include <set>
 #include <span>
 #include <string>
 #include <string_view>
 #include <sys/wait.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
@@ -58,15 +65,29 @@
 #include "output-stream-lock.hh"
 #include "constituents.hh"
 #include "store.hh"
+#include "scheduler.hh"
+#include "attr-path-table.hh"
+#include "zygote.hh"
+#include "history.hh"
+#include "result-cache.hh"
+#include "cache-status.hh"
+#include "output-writer.hh"
+#include "json-fields.hh"
 
 namespace {
 MyArgs myArgs; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+/* Set by main while the collectors are running */
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+OutputWriter *outputWriter = nullptr;
+/* With --constituents */
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+ConstituentResolver *constituentResolver = nullptr;
 
 using Processor = std::function<void(MyArgs &myArgs, nix::AutoCloseFD &toFd,
                                      nix::AutoCloseFD &fromFd)>;
 
-void handleConstituents(std::map<std::string, nlohmann::json> &jobs,
-                        const MyArgs &args) {
+void handleConstituents(std::map<std::string, JobRecord> &jobs,
+                        DerivationCache &derivations, const MyArgs &args) {
 
     auto store = nix_eval_jobs::openStore(args.evalStoreUrl);
     auto localStore = store.dynamic_pointer_cast<nix::LocalFSStore>();
@@ -79,32 +100,22 @@ void handleConstituents(std::map<std::string, nlohmann::json> &jobs,
 
     auto localStoreRef = nix::ref<nix::LocalFSStore>(localStore);
 
-    std::visit(
-        nix::overloaded{
-            [&](const std::vector<AggregateJob> &namedConstituents) -> void {
-                rewriteAggregates(jobs, namedConstituents, localStoreRef,
-                                  args.gcRootsDir);
-            },
-            [&](const DependencyCycle &cycle) -> void {
-                nix::logger->log(nix::lvlError,
-                                 nix::fmt("Found dependency cycle "
-                                          "between jobs '%s' and '%s'",
-                                          cycle.a, cycle.b));
-                jobs[cycle.a]["error"] = cycle.message();
-                jobs[cycle.b]["error"] = cycle.message();
-
-                getCoutLock().lock() << jobs[cycle.a].dump() << "\n"
-                                     << jobs[cycle.b].dump() << "\n";
-
-                for (const auto &jobName : cycle.remainingAggregates) {
-                    jobs[jobName]["error"] =
-                        "Skipping aggregate because of a dependency "
-                        "cycle";
-                    getCoutLock().lock() << jobs[jobName].dump() << "\n";
-                }
-            },
-        },
-        resolveNamedConstituents(jobs));
+    auto resolved = resolveNamedConstituents(jobs);
+    rewriteAggregates(jobs, resolved.sorted, localStoreRef, derivations,
+                      args.gcRootsDir);
+
+    // The aggregates depending on a cycle have failed above, naming it
+    for (const auto &cycle : resolved.cycles) {
+        nix::logger->log(nix::lvlError,
+                         nix::fmt("Found dependency cycle between jobs '%s'",
+                                  nix::concatStringsSep("', '",
+                                                        cycle.aggregates)));
+        for (const auto &jobName : cycle.aggregates) {
+            auto &job = jobs.at(jobName).aggregate.value();
+            job["error"] = cycle.message();
+            getCoutLock().lock() << job.dump() << "\n";
+        }
+    }
 }
 
 /* Auto-cleanup of fork's process and fds. */
@@ -122,6 +133,7 @@ struct Proc {
         nix::Pipe fromPipe;
         toPipe.create();
         fromPipe.create();
+        enlargePipeBuffer(fromPipe.writeSide.get());
         auto childPid = startProcess(
             [&,
              toFd{std::make_shared<nix::AutoCloseFD>(
@@ -134,18 +146,7 @@ struct Proc {
                 try {
                     proc(myArgs, *toFd, *fromFd);
                 } catch (nix::Error &e) {
-                    nlohmann::json err;
-                    const auto &msg = e.msg();
-                    err["error"] = nix::filterANSIEscapes(msg, true);
-                    nix::logger->log(nix::lvlError, msg);
-                    if (tryWriteLine(toFd->get(), err.dump()) < 0) {
-                        return; // main process died
-                    };
-                    // Don't forget to print it into the STDERR log, this is
-                    // what's shown in the Hydra UI.
-                    if (tryWriteLine(toFd->get(), "restart") < 0) {
-                        return; // main process died
-                    }
+                    reportWorkerError(toFd->get(), e);
                 }
             },
             nix::ProcessOptions{.allowVfork = false});
@@ -155,6 +156,17 @@ struct Proc {
         pid = childPid;
     }
 
+    explicit Proc(Zygote &zygote) {
+        nix::Pipe toPipe;
+        nix::Pipe fromPipe;
+        toPipe.create();
+        fromPipe.create();
+        enlargePipeBuffer(fromPipe.writeSide.get());
+        pid = zygote.spawn(fromPipe.writeSide.get(), toPipe.readSide.get());
+        to = std::move(toPipe.writeSide);
+        from = std::move(fromPipe.readSide);
+    }
+
     ~Proc() = default;
 };
 
@@ -230,12 +242,85 @@ struct Thread {
 };
 // NOLINTEND(misc-include-cleaner)
 
+/* Reported with --show-stats */
+struct Stats {
+    size_t workerRestarts = 0;
+    /* Restarts where the replacement was started before the old worker
+       exited, see --respawn-threshold */
+    size_t overlappedRestarts = 0;
+    /* Time collectors spent waiting for workers started on demand */
+    std::chrono::steady_clock::duration coldStartTime{};
+    size_t coldStarts = 0;
+    /* Startup time of overlapped replacements that collectors did not wait
+       for, estimated from the average cold start */
+    std::chrono::steady_clock::duration savedStartTime{};
+    /* With --max-workers */
+    size_t workersStarted = 0;
+    size_t workersRetired = 0;
+    size_t peakWorkers = 0;
+    /* Jobs sent to workers, including ones resent after a restart */
+    size_t jobs = 0;
+    /* Jobs sent to a worker that had not evaluated their parent, because it
+       was stolen from another collector or the worker restarted */
+    size_t remoteJobs = 0;
+    /* Parent attribute sets evaluated again in another worker */
+    size_t duplicatedParentEvaluations = 0;
+    /* With --result-cache */
+    size_t resultCacheHits = 0;
+    size_t resultCacheMisses = 0;
+    /* With --check-cache-status */
+    CacheStatusResolver::Stats cacheStatus;
+    /* With --constituents, output names of constituents */
+    DerivationCache::Stats constituents;
+    OutputWriter::Stats output;
+
+    [[nodiscard]] auto toJson() const -> nlohmann::json {
+        using Seconds = std::chrono::duration<double>;
+        return {
+            {"workers",
+             {
+                 {"restarts", workerRestarts},
+                 {"overlappedRestarts", overlappedRestarts},
+                 {"coldStarts", coldStarts},
+                 {"coldStartSeconds", Seconds(coldStartTime).count()},
+                 {"savedStartSeconds", Seconds(savedStartTime).count()},
+                 {"started", workersStarted},
+                 {"retired", workersRetired},
+                 {"peak", peakWorkers},
+             }},
+            {"affinity",
+             {
+                 {"jobs", jobs},
+                 {"remoteJobs", remoteJobs},
+                 {"duplicatedParentEvaluations", duplicatedParentEvaluations},
+             }},
+            {"resultCache",
+             {
+                 {"hits", resultCacheHits},
+                 {"misses", resultCacheMisses},
+             }},
+            {"cacheStatus",
+             {
+                 {"hits", cacheStatus.hits},
+                 {"misses", cacheStatus.misses},
+             }},
+            {"constituents",
+             {
+                 {"hits", constituents.hits},
+                 {"misses", constituents.misses},
+             }},
+            {"output",
+             {
+                 {"spilledLines", output.spilledLines},
+                 {"spills", output.spills},
+             }},
+        };
+    }
+};
+
 struct State {
-    std::set<nlohmann::json> todo =
-        nlohmann::json::array({nlohmann::json::array()});
-    std::set<nlohmann::json> active;
-    std::map<std::string, nlohmann::json> jobs;
     std::exception_ptr exc;
+    Stats stats;
 };
 
 void handleBrokenWorkerPipe(Proc &proc, std::string_view msg) {
@@ -304,163 +389,604 @@ void handleBrokenWorkerPipe(Proc &proc, std::string_view msg) {
     }
 }
 
-auto joinAttrPath(const nlohmann::json &attrPath) -> std::string {
-    std::string joined;
-    for (const auto &element : attrPath) {
-        if (!joined.empty()) {
-            joined += '.';
-        }
-        joined += element.get<std::string>();
+namespace {
+/* Throws the error reported by a FrameType::Error frame */
+[[noreturn]] void throwWorkerError(const Frame &frame) {
+    try {
+        auto json = nlohmann::json::parse(frame.payload);
+        throw nix::Error("worker error: %s", std::string(json["error"]));
+    } catch (const nlohmann::json::exception &e) {
+        throw nix::Error("Received invalid JSON from worker: %s\n json: '%s'",
+                         e.what(), frame.payload);
     }
-    return joined;
 }
 
-namespace {
-auto checkWorkerStatus(LineReader *fromReader, Proc *proc) -> std::string_view {
-    auto line = fromReader->readLine();
-    if (line.empty()) {
+auto checkWorkerStatus(FrameReader *fromReader, Proc *proc) -> Frame {
+    auto frame = fromReader->readFrame();
+    if (!frame.has_value()) {
         handleBrokenWorkerPipe(*proc, "checking worker process");
     }
-    if (line != "next" && line != "restart") {
-        try {
-            auto json = nlohmann::json::parse(line);
-            throw nix::Error("worker error: %s", std::string(json["error"]));
-        } catch (const nlohmann::json::exception &e) {
-            throw nix::Error(
-                "Received invalid JSON from worker: %s\n json: '%s'", e.what(),
-                line);
-        }
+    const auto type = frame->header.type;
+    if (type == FrameType::Error) {
+        throwWorkerError(*frame);
+    }
+    if (type != FrameType::Next && type != FrameType::Restart &&
+        type != FrameType::Fingerprint) {
+        throw nix::Error("Received unexpected frame type %d from worker",
+                         static_cast<int>(type));
     }
-    return line;
+    return *frame;
 }
 
-auto getNextJob(nix::Sync<State> &state_, std::condition_variable &wakeup,
-                Proc *proc) -> std::optional<nlohmann::json> {
-    nlohmann::json attrPath;
-    while (true) {
-        nix::checkInterrupt();
-        auto state(state_.lock());
-        if ((state->todo.empty() && state->active.empty()) || state->exc) {
-            if (tryWriteLine(proc->to.get(), "exit") < 0) {
-                handleBrokenWorkerPipe(*proc, "sending exit");
-            }
-            return std::nullopt;
+/* Chooses how many attribute paths to hand to a worker at once. Batches grow
+   while jobs are cheap, so that tiny leaf attrsets do not pay a pipe round
+   trip each, and shrink back to single jobs once jobs get expensive, so that
+   idle collectors can still steal the remaining work. */
+class BatchSizer {
+  public:
+    explicit BatchSizer(size_t maxSize) : maxSize(maxSize) {}
+
+    [[nodiscard]] auto next() const -> size_t {
+        if (maxSize <= 1 || avgJobMicros <= 0) {
+            return 1;
         }
-        if (!state->todo.empty()) {
-            attrPath = *state->todo.begin();
-            state->todo.erase(state->todo.begin());
-            state->active.insert(attrPath);
-            return attrPath;
+        const double size = TARGET_BATCH_MICROS / avgJobMicros;
+        return std::clamp(static_cast<size_t>(size), size_t{1}, maxSize);
+    }
+
+    void record(size_t jobs, std::chrono::steady_clock::duration elapsed) {
+        const auto micros =
+            std::chrono::duration<double, std::micro>(elapsed).count() /
+            static_cast<double>(jobs);
+        avgJobMicros = avgJobMicros <= 0
+                           ? micros
+                           : (SMOOTHING * micros) +
+                                 ((1 - SMOOTHING) * avgJobMicros);
+    }
+
+  private:
+    static constexpr double TARGET_BATCH_MICROS = 20000;
+    static constexpr double SMOOTHING = 0.2;
+    size_t maxSize;
+    double avgJobMicros = 0;
+};
+
+auto getNextBatch(JobScheduler &scheduler, size_t queue, size_t batchSize,
+                  Proc *proc) -> std::vector<AttrPathId> {
+    auto attrPath = scheduler.pop(queue);
+    if (!attrPath.has_value()) {
+        if (tryWriteFrame(proc->to.get(), {.type = FrameType::Exit}) < 0) {
+            handleBrokenWorkerPipe(*proc, "sending exit");
         }
-        state.wait(wakeup);
+        return {};
+    }
+    std::vector<AttrPathId> batch{attrPath.value()};
+    for (auto more : scheduler.popMore(queue, batchSize - 1)) {
+        batch.push_back(more);
     }
+    return batch;
 }
 
-auto processWorkerResponse(LineReader *fromReader,
-                           const nlohmann::json &attrPath, Proc *proc,
-                           nix::Sync<State> &state_)
-    -> std::vector<nlohmann::json> {
-    // Read response from worker
-    auto respString = fromReader->readLine();
-    if (respString.empty()) {
+void sendBatch(const std::vector<AttrPathId> &batch, AttrPathTable &attrPaths,
+               Proc *proc) {
+    auto paths = nlohmann::json::array();
+    for (auto attrPath : batch) {
+        paths.push_back(attrPaths.toJson(attrPath));
+    }
+    const FrameHeader header{.type = FrameType::Do,
+                             .childCount =
+                                 static_cast<uint32_t>(batch.size())};
+    if (tryWriteFrame(proc->to.get(), header, paths.dump()) < 0) {
         auto msg =
-            "reading result for attrPath '" + joinAttrPath(attrPath) + "'";
+            "sending attrPath '" + attrPaths.dotted(batch.front()) + "'";
         handleBrokenWorkerPipe(*proc, msg);
     }
+}
 
-    // Parse JSON response
-    nlohmann::json response;
+/* What --constituents keeps of a job, keyed by its "attr". Of jobs other
+   than aggregates, only the fields aggregates look at are parsed, skipping
+   over "meta" and the like. */
+auto makeJobRecord(std::string_view payload, uint8_t status)
+    -> std::pair<std::string, JobRecord> {
+    JobRecord record;
+    std::optional<nlohmann::json> attr;
     try {
-        response = nlohmann::json::parse(respString);
+        const JsonFields fields(payload);
+        attr = fields.get("attr");
+        if (auto drvPath = fields.get("drvPath")) {
+            record.drvPath = drvPath->get<std::string>();
+        }
+        if (auto error = fields.get("error")) {
+            record.error = error->get<std::string>();
+        }
+        if ((status & FrameStatusAggregate) != 0) {
+            record.aggregate = nlohmann::json::parse(payload);
+        }
     } catch (const nlohmann::json::exception &e) {
         throw nix::Error("Received invalid JSON from worker: %s\n json: '%s'",
-                         e.what(), respString);
+                         e.what(), payload);
+    } catch (const nix::Error &e) {
+        throw nix::Error("Received invalid JSON from worker: %s\n json: '%s'",
+                         e.msg(), payload);
+    }
+    if (!attr.has_value() || !attr->is_string()) {
+        throw nix::Error("Received job without \"attr\" from worker: '%s'",
+                         payload);
+    }
+    return {attr->get<std::string>(), std::move(record)};
+}
+
+/* Job payloads are forwarded to the output as they are, aggregates once
+   the ConstituentResolver has rewritten them. With --check-cache-status,
+   they go through the resolver first, which calls back with cacheStatus
+   filled in. */
+void emitJob(std::string_view payload, uint8_t status,
+             CacheStatusResolver *cacheStatus) {
+    if (cacheStatus != nullptr) {
+        cacheStatus->submit(std::string(payload), status);
+        return;
+    }
+    // Written before the resolver sees it, so an aggregate is never written
+    // ahead of its constituents
+    if ((status & FrameStatusAggregate) == 0) {
+        outputWriter->write(payload);
     }
+    if (myArgs.constituents) {
+        auto [attr, record] = makeJobRecord(payload, status);
+        constituentResolver->submit(std::move(attr), std::move(record));
+    }
+}
 
-    // Process the response
-    std::vector<nlohmann::json> newAttrs;
-    if (response.find("attrs") != response.end()) {
-        for (const auto &attr : response["attrs"]) {
-            nlohmann::json newAttr = nlohmann::json(response["attrPath"]);
-            newAttr.emplace_back(attr);
-            newAttrs.push_back(newAttr);
+void storeResult(ResultCache &resultCache, AttrPathTable &attrPaths,
+                 AttrPathId attrPath, const Frame &frame) {
+    const auto &header = frame.header;
+    ResultCache::Result result{.type = header.type, .status = header.status};
+    if (header.type == FrameType::Attrs) {
+        auto names = nlohmann::json::array();
+        std::string_view payload = frame.payload;
+        for (uint32_t i = 0; i < header.childCount; i++) {
+            auto nameEnd = payload.find('\0');
+            names.push_back(std::string(payload.substr(0, nameEnd)));
+            payload.remove_prefix(nameEnd + 1);
         }
+        result.payload = names.dump();
+    } else if ((header.status & FrameStatusFailed) == 0) {
+        result.payload = frame.payload;
     } else {
-        {
-            auto state(state_.lock());
-            state->jobs.insert_or_assign(response["attr"], response);
+        return; // errors may be transient, evaluate them again next time
+    }
+    resultCache.store(attrPaths.toJson(attrPath).dump(), result);
+}
+
+/* Returns std::nullopt if the worker asked for a restart instead of
+   replying. Only the frame header is decoded. */
+auto processWorkerResponse(FrameReader *fromReader, AttrPathId attrPath,
+                           uint32_t index, AttrPathTable &attrPaths,
+                           History *history, ResultCache *resultCache,
+                           CacheStatusResolver *cacheStatus, Proc *proc)
+    -> std::optional<std::vector<AttrPathId>> {
+    auto frame = fromReader->readFrame();
+    if (!frame.has_value()) {
+        auto msg =
+            "reading result for attrPath '" + attrPaths.dotted(attrPath) + "'";
+        handleBrokenWorkerPipe(*proc, msg);
+    }
+    const auto &header = frame->header;
+    if (header.type == FrameType::Restart) {
+        return std::nullopt;
+    }
+    // The worker failed outside of any job, e.g. in the middle of a batch
+    if (header.type == FrameType::Error) {
+        throwWorkerError(*frame);
+    }
+    if ((header.type != FrameType::Attrs && header.type != FrameType::Job) ||
+        header.attr != index) {
+        throw nix::Error("Received unexpected frame from worker for attrPath "
+                         "'%s' (type %d)",
+                         attrPaths.dotted(attrPath),
+                         static_cast<int>(header.type));
+    }
+
+    if (history != nullptr) {
+        static constexpr double MICROS_PER_SECOND = 1e6;
+        history->record(
+            attrPath,
+            {.seconds = header.evalMicros / MICROS_PER_SECOND,
+             .children =
+                 header.type == FrameType::Attrs ? header.childCount : 0,
+             .rssDeltaKiB = header.rssDeltaKiB});
+    }
+    if (resultCache != nullptr) {
+        storeResult(*resultCache, attrPaths, attrPath, *frame);
+    }
+
+    std::vector<AttrPathId> newAttrs;
+    if (header.type == FrameType::Attrs) {
+        newAttrs.reserve(header.childCount);
+        std::string_view names = frame->payload;
+        for (uint32_t i = 0; i < header.childCount; i++) {
+            auto nameEnd = names.find('\0');
+            newAttrs.push_back(
+                attrPaths.child(attrPath, names.substr(0, nameEnd)));
+            names.remove_prefix(nameEnd + 1);
         }
-        auto named = response.find("namedConstituents");
-        if (named == response.end() || named->empty()) {
-            getCoutLock().lock() << respString << "\n";
+        if (history != nullptr) {
+            history->orderChildren(newAttrs);
         }
+        return newAttrs;
     }
 
+    emitJob(frame->payload, header.status, cacheStatus);
     return newAttrs;
 }
 
-void updateJobQueue(nix::Sync<State> &state_, std::condition_variable &wakeup,
-                    const nlohmann::json &attrPath,
-                    const std::vector<nlohmann::json> &newAttrs) {
+/* Reads one reply per path of the batch and returns how many were received.
+   If the worker restarted before finishing the batch, the unprocessed paths
+   are handed back to the scheduler. */
+auto processBatch(FrameReader *fromReader, const std::vector<AttrPathId> &batch,
+                  AttrPathTable &attrPaths, History *history,
+                  ResultCache *resultCache, CacheStatusResolver *cacheStatus,
+                  Proc *proc, JobScheduler &scheduler, size_t queue)
+    -> size_t {
+    for (size_t i = 0; i < batch.size(); i++) {
+        auto newAttrs = processWorkerResponse(
+            fromReader, batch[i], static_cast<uint32_t>(i), attrPaths, history,
+            resultCache, cacheStatus, proc);
+        if (!newAttrs.has_value()) {
+            auto unprocessed =
+                std::next(batch.begin(), static_cast<std::ptrdiff_t>(i));
+            scheduler.requeue(
+                queue, std::vector<AttrPathId>(unprocessed, batch.end()));
+            return i;
+        }
+        scheduler.complete(queue, std::move(newAttrs.value()));
+    }
+    return batch.size();
+}
+
+/* Emits the paths of the batch found in --result-cache as if a worker had
+   evaluated them and returns the others. */
+auto serveCached(const std::vector<AttrPathId> &batch,
+                 ResultCache &resultCache, AttrPathTable &attrPaths,
+                 History *history, nix::Sync<State> &state_,
+                 JobScheduler &scheduler, size_t queue)
+    -> std::vector<AttrPathId> {
+    std::vector<AttrPathId> misses;
+    for (const auto attrPath : batch) {
+        auto result = resultCache.lookup(attrPaths.toJson(attrPath).dump());
+        if (!result.has_value()) {
+            misses.push_back(attrPath);
+            continue;
+        }
+        std::vector<AttrPathId> newAttrs;
+        if (result->type == FrameType::Attrs) {
+            for (const auto &name : nlohmann::json::parse(result->payload)) {
+                newAttrs.push_back(
+                    attrPaths.child(attrPath, name.get<std::string>()));
+            }
+            if (history != nullptr) {
+                history->orderChildren(newAttrs);
+            }
+        } else {
+            // --result-cache is ignored with --check-cache-status
+            emitJob(result->payload, result->status, nullptr);
+        }
+        scheduler.complete(queue, std::move(newAttrs));
+    }
+
     auto state(state_.lock());
-    state->active.erase(attrPath);
-    for (const auto &newAttr : newAttrs) {
-        state->todo.insert(newAttr);
+    state->stats.resultCacheHits += batch.size() - misses.size();
+    state->stats.resultCacheMisses += misses.size();
+    return misses;
+}
+
+/* A worker process and the reader for its replies */
+struct WorkerHandle {
+    std::unique_ptr<Proc> proc;
+    std::unique_ptr<FrameReader> fromReader;
+    std::chrono::steady_clock::time_point spawned;
+    /* Attribute paths whose values are already forced in the worker's heap,
+       i.e. jobs sent to it and their parents */
+    std::unordered_set<AttrPathId> forced;
+};
+
+/* The worker looks up every job starting from the root, forcing all parent
+   attribute sets on the way. Returns how many of those parents the worker
+   has not forced before. As every parent has already been evaluated by some
+   worker to discover the job, each of them is evaluated once more. */
+auto forceParents(WorkerHandle &worker, AttrPathTable &attrPaths,
+                  AttrPathId job) -> size_t {
+    size_t duplicated = 0;
+    for (auto parent = attrPaths.parent(job);
+         parent != AttrPathTable::ROOT && worker.forced.insert(parent).second;
+         parent = attrPaths.parent(parent)) {
+        duplicated++;
     }
-    wakeup.notify_all();
+    worker.forced.insert(job);
+    return duplicated;
+}
+
+auto spawnWorker(Zygote *zygote) -> WorkerHandle {
+    const auto spawned = std::chrono::steady_clock::now();
+    auto proc = zygote != nullptr ? std::make_unique<Proc>(*zygote)
+                                  : std::make_unique<Proc>(worker);
+    auto fromReader = std::make_unique<FrameReader>(proc->from.release());
+    return {.proc = std::move(proc),
+            .fromReader = std::move(fromReader),
+            .spawned = spawned};
 }
 } // namespace
 
-void collector(nix::Sync<State> &state_, std::condition_variable &wakeup) {
+void collector(nix::Sync<State> &state_, JobScheduler &scheduler,
+               AttrPathTable &attrPaths, History *history,
+               ResultCache *resultCache, CacheStatusResolver *cacheStatus,
+               Zygote *zygote, size_t queue,
+               std::atomic<uint64_t> &workerRss) {
     try {
-        std::optional<std::unique_ptr<Proc>> proc_;
-        std::optional<std::unique_ptr<LineReader>> fromReader_;
+        std::optional<WorkerHandle> current;
+        /* Started when the current worker got close to its memory limit */
+        std::optional<WorkerHandle> spare;
+        BatchSizer batchSizer(myArgs.maxBatchSize);
 
         while (true) {
             // Initialize worker if needed
-            if (!proc_.has_value()) {
-                proc_ = std::make_unique<Proc>(worker);
-            }
-            if (!fromReader_.has_value()) {
-                fromReader_ =
-                    std::make_unique<LineReader>(proc_.value()->from.release());
+            bool coldStart = false;
+            if (!current.has_value()) {
+                if (spare.has_value()) {
+                    auto state(state_.lock());
+                    auto &stats = state->stats;
+                    stats.overlappedRestarts++;
+                    if (stats.coldStarts > 0) {
+                        const auto avgColdStart =
+                            stats.coldStartTime /
+                            static_cast<int64_t>(stats.coldStarts);
+                        const auto headStart =
+                            std::chrono::steady_clock::now() - spare->spawned;
+                        stats.savedStartTime +=
+                            std::min(headStart, avgColdStart);
+                    }
+                    current = std::move(spare);
+                    spare = std::nullopt;
+                } else {
+                    current = spawnWorker(zygote);
+                    coldStart = true;
+                }
             }
 
-            auto line = checkWorkerStatus(fromReader_.value().get(),
-                                          proc_.value().get());
-            if (line == "restart") {
+            auto frame = checkWorkerStatus(current->fromReader.get(),
+                                           current->proc.get());
+            const auto &header = frame.header;
+            if (coldStart) {
+                auto state(state_.lock());
+                state->stats.coldStarts++;
+                state->stats.coldStartTime +=
+                    std::chrono::steady_clock::now() - current->spawned;
+            }
+            if (header.type == FrameType::Fingerprint) {
+                if (resultCache != nullptr) {
+                    resultCache->setFingerprint(frame.payload);
+                }
+                continue;
+            }
+            if (header.type == FrameType::Restart) {
                 // Reset worker
-                proc_ = std::nullopt;
-                fromReader_ = std::nullopt;
+                current = std::nullopt;
+                state_.lock()->stats.workerRestarts++;
                 continue;
             }
+            if (frame.payload.size() == sizeof(uint64_t)) {
+                uint64_t rss = 0;
+                std::memcpy(&rss, frame.payload.data(), sizeof(rss));
+                workerRss = rss;
+            }
+            if ((header.status & FrameStatusRespawn) != 0 &&
+                !spare.has_value()) {
+                spare = spawnWorker(zygote);
+            }
 
-            auto maybeAttrPath =
-                getNextJob(state_, wakeup, proc_.value().get());
-            if (!maybeAttrPath.has_value()) {
+            auto batch = getNextBatch(scheduler, queue, batchSizer.next(),
+                                      current->proc.get());
+            while (resultCache != nullptr && !batch.empty()) {
+                batch = serveCached(batch, *resultCache, attrPaths, history,
+                                    state_, scheduler, queue);
+                if (!batch.empty()) {
+                    break;
+                }
+                batch = getNextBatch(scheduler, queue, batchSizer.next(),
+                                     current->proc.get());
+            }
+            if (batch.empty()) {
+                if (myArgs.evalCache) {
+                    // Let the worker commit its eval cache before it is killed
+                    (void)current->fromReader->readFrame();
+                }
+                workerRss = 0;
                 return;
             }
-            const auto &attrPath = maybeAttrPath.value();
 
-            if (tryWriteLine(proc_.value()->to.get(), "do " + attrPath.dump()) <
-                0) {
-                auto msg = "sending attrPath '" + joinAttrPath(attrPath) + "'";
-                handleBrokenWorkerPipe(*proc_.value(), msg);
+            size_t remoteJobs = 0;
+            size_t duplicated = 0;
+            for (const auto job : batch) {
+                const auto parents = forceParents(*current, attrPaths, job);
+                remoteJobs += parents > 0 ? 1 : 0;
+                duplicated += parents;
+            }
+            {
+                auto state(state_.lock());
+                state->stats.jobs += batch.size();
+                state->stats.remoteJobs += remoteJobs;
+                state->stats.duplicatedParentEvaluations += duplicated;
             }
 
-            auto newAttrs =
-                processWorkerResponse(fromReader_.value().get(), attrPath,
-                                      proc_.value().get(), state_);
-
-            updateJobQueue(state_, wakeup, attrPath, newAttrs);
+            const auto start = std::chrono::steady_clock::now();
+            sendBatch(batch, attrPaths, current->proc.get());
+            auto processed =
+                processBatch(current->fromReader.get(), batch, attrPaths,
+                             history, resultCache, cacheStatus,
+                             current->proc.get(), scheduler, queue);
+            if (processed > 0) {
+                batchSizer.record(processed,
+                                  std::chrono::steady_clock::now() - start);
+            }
+            if (processed < batch.size()) {
+                // Worker restarted in the middle of the batch
+                current = std::nullopt;
+                state_.lock()->stats.workerRestarts++;
+            }
         }
     } catch (...) {
-        auto state(state_.lock());
-        state->exc = std::current_exception();
-        wakeup.notify_all();
+        workerRss = 0;
+        {
+            auto state(state_.lock());
+            state->exc = std::current_exception();
+        }
+        scheduler.abort();
     }
 }
 
+/* The collector threads, each with its own worker process. Slot `i` runs
+   the collector for queue `i` of the scheduler. With --max-workers, the
+   main thread adds collectors while jobs are piling up and the workers fit
+   into --memory-budget, and retires them when the workers exceed the budget
+   or collectors sit idle. */
+class CollectorPool {
+  public:
+    CollectorPool(nix::Sync<State> &state, JobScheduler &scheduler,
+                  AttrPathTable &attrPaths, History *history,
+                  ResultCache *resultCache, CacheStatusResolver *cacheStatus,
+                  Zygote *zygote, size_t nrSlots)
+        : state_(state), scheduler(scheduler), attrPaths(attrPaths),
+          history(history), resultCache(resultCache), cacheStatus(cacheStatus),
+          zygote(zygote), slots(nrSlots) {}
+
+    void start(size_t slot) {
+        auto &entry = slots[slot];
+        if (entry.thread) {
+            entry.thread->join();
+        }
+        scheduler.reopen(slot);
+        entry.retired = false;
+        entry.running = true;
+        entry.thread = std::make_unique<Thread>([this, slot] -> void {
+            collector(state_, scheduler, attrPaths, history, resultCache,
+                      cacheStatus, zygote, slot, slots[slot].workerRss);
+            slots[slot].running = false;
+        });
+
+        const auto active = std::ranges::count_if(
+            slots, [](const Slot &other) -> bool {
+                return other.running && !other.retired;
+            });
+        auto state(state_.lock());
+        state->stats.peakWorkers = std::max(state->stats.peakWorkers,
+                                            static_cast<size_t>(active));
+    }
+
+    /* Runs until the scheduler is finished */
+    void autoscale() {
+        const uint64_t budgetMiB =
+            myArgs.memoryBudget > 0 ? myArgs.memoryBudget
+                                    : myArgs.maxWorkers * myArgs.maxMemorySize;
+        const uint64_t budget = budgetMiB * KIB_PER_MIB;
+        size_t idleTicks = 0;
+
+        while (!scheduler.finished()) {
+            nix::checkInterrupt();
+            std::this_thread::sleep_for(AUTOSCALE_INTERVAL);
+
+            size_t active = 0;
+            uint64_t totalRss = 0;
+            std::optional<size_t> largest;
+            /* The largest of the collectors waiting for work */
+            std::optional<size_t> largestIdle;
+            std::optional<size_t> freeSlot;
+            for (size_t i = 0; i < slots.size(); i++) {
+                const auto &entry = slots[i];
+                if (!entry.running) {
+                    freeSlot = freeSlot.value_or(i);
+                    continue;
+                }
+                if (entry.retired) {
+                    continue;
+                }
+                active++;
+                totalRss += entry.workerRss;
+                if (!largest || entry.workerRss > slots[*largest].workerRss) {
+                    largest = i;
+                }
+                if (scheduler.isIdle(i) &&
+                    (!largestIdle ||
+                     entry.workerRss > slots[*largestIdle].workerRss)) {
+                    largestIdle = i;
+                }
+            }
+            if (totalRss > budget && active > myArgs.minWorkers && largest) {
+                retire(*largest);
+                continue;
+            }
+
+            idleTicks = scheduler.idleCollectors() > 0 ? idleTicks + 1 : 0;
+            if (idleTicks >= IDLE_TICKS_BEFORE_RETIRE &&
+                active > myArgs.minWorkers && largestIdle) {
+                idleTicks = 0;
+                retire(*largestIdle);
+                continue;
+            }
+
+            // Assume a new worker grows as large as the current average
+            const uint64_t newRss =
+                totalRss > 0 ? totalRss / active
+                             : myArgs.maxMemorySize * KIB_PER_MIB;
+            if (freeSlot && active < myArgs.maxWorkers &&
+                scheduler.idleCollectors() == 0 &&
+                scheduler.queuedJobs() > active &&
+                totalRss + newRss <= budget) {
+                start(*freeSlot);
+                state_.lock()->stats.workersStarted++;
+            }
+        }
+    }
+
+    void join() {
+        for (auto &entry : slots) {
+            if (entry.thread) {
+                entry.thread->join();
+                entry.thread.reset();
+            }
+        }
+    }
+
+  private:
+    static constexpr auto AUTOSCALE_INTERVAL = std::chrono::milliseconds(100);
+    static constexpr size_t IDLE_TICKS_BEFORE_RETIRE = 10;
+    static constexpr uint64_t KIB_PER_MIB = 1024;
+
+    struct Slot {
+        std::unique_ptr<Thread> thread;
+        /* Cleared by the collector thread when it exits */
+        std::atomic<bool> running = false;
+        /* Only touched by the main thread */
+        bool retired = false;
+        /* As last reported by the worker, in KiB */
+        std::atomic<uint64_t> workerRss = 0;
+    };
+
+    nix::Sync<State> &state_;
+    JobScheduler &scheduler;
+    AttrPathTable &attrPaths;
+    History *history;
+    ResultCache *resultCache;
+    CacheStatusResolver *cacheStatus;
+    Zygote *zygote;
+    std::vector<Slot> slots;
+
+    void retire(size_t slot) {
+        slots[slot].retired = true;
+        scheduler.retire(slot);
+        state_.lock()->stats.workersRetired++;
+    }
+};
+
 void validateIncompatibleFlags(const MyArgs &args) {
     if (!args.noInstantiate) {
         return;
@@ -537,6 +1063,11 @@ auto main(int argc, char **argv) -> int {
             throw nix::UsageError("no expression specified");
         }
 
+        if (myArgs.maxWorkers > 0 && myArgs.minWorkers > myArgs.maxWorkers) {
+            throw nix::UsageError(
+                "--min-workers must not be larger than --max-workers");
+        }
+
         if (!myArgs.gcRootsDir.empty()) {
             myArgs.gcRootsDir = std::filesystem::absolute(myArgs.gcRootsDir);
         }
@@ -545,29 +1076,121 @@ auto main(int argc, char **argv) -> int {
             nix::loggerSettings.showTrace.assign(true);
         }
 
+        /* Jobs of impure evaluations and their cache status depend on more
+           than the locked flake */
+        if (!myArgs.resultCacheFile.empty() &&
+            (!myArgs.flake || myArgs.impure || myArgs.checkCacheStatus)) {
+            nix::warn("ignoring --result-cache, it requires --flake without "
+                      "--impure and --check-cache-status");
+            myArgs.resultCacheFile.clear();
+        }
+        if (myArgs.evalCache && (!myArgs.flake || myArgs.impure)) {
+            nix::warn("ignoring --eval-cache, it requires --flake without "
+                      "--impure");
+            myArgs.evalCache = false;
+        }
+
+        /* Forked before any collector thread exists */
+        std::unique_ptr<Zygote> zygote;
+        if (myArgs.zygote) {
+            becomeChildSubreaper();
+            zygote = std::make_unique<Zygote>(
+                [](nix::AutoCloseFD &control) -> void {
+                    runZygote(myArgs, control);
+                });
+        }
+
         nix::Sync<State> state_;
 
-        /* Start a collector thread per worker process. */
-        std::vector<Thread> threads;
-        std::condition_variable wakeup;
-        threads.reserve(myArgs.nrWorkers);
-        for (size_t i = 0; i < myArgs.nrWorkers; i++) {
-            threads.emplace_back(
-                [&state_, &wakeup] -> void { collector(state_, wakeup); });
+        AttrPathTable attrPaths;
+        const bool autoscale = myArgs.maxWorkers > 0;
+        const size_t nrSlots = autoscale ? myArgs.maxWorkers : myArgs.nrWorkers;
+        JobScheduler scheduler(nrSlots);
+
+        std::unique_ptr<History> history;
+        if (!myArgs.historyFile.empty()) {
+            history = std::make_unique<History>(attrPaths);
+            history->load(myArgs.historyFile);
         }
 
-        for (auto &thread : threads) {
-            thread.join();
+        std::unique_ptr<ResultCache> resultCache;
+        if (!myArgs.resultCacheFile.empty()) {
+            resultCache = std::make_unique<ResultCache>(
+                myArgs.resultCacheFile, myArgs.resultCacheKey(),
+                nix_eval_jobs::openStore(myArgs.evalStoreUrl),
+                myArgs.gcRootsDir);
         }
 
+        OutputWriter output(STDOUT_FILENO,
+                            myArgs.spillOutput
+                                ? OutputWriter::Backpressure::Spill
+                                : OutputWriter::Backpressure::Block);
+        outputWriter = &output;
+
+        std::unique_ptr<ConstituentResolver> constituents;
+        if (myArgs.constituents) {
+            constituents = std::make_unique<ConstituentResolver>(
+                nix_eval_jobs::openStore(myArgs.evalStoreUrl),
+                myArgs.gcRootsDir, [](std::string_view payload) -> void {
+                    outputWriter->write(payload);
+                });
+            constituentResolver = constituents.get();
+        }
+
+        std::unique_ptr<CacheStatusResolver> cacheStatus;
+        if (myArgs.checkCacheStatus) {
+            cacheStatus = std::make_unique<CacheStatusResolver>(
+                nix_eval_jobs::openStore(myArgs.evalStoreUrl),
+                [](std::string_view payload, uint8_t status) -> void {
+                    emitJob(payload, status, nullptr);
+                });
+        }
+
+        /* Start a collector thread per worker process. */
+        CollectorPool pool(state_, scheduler, attrPaths, history.get(),
+                           resultCache.get(), cacheStatus.get(), zygote.get(),
+                           nrSlots);
+        const size_t initialWorkers =
+            autoscale ? myArgs.minWorkers : myArgs.nrWorkers;
+        for (size_t i = 0; i < initialWorkers; i++) {
+            pool.start(i);
+        }
+        if (autoscale) {
+            pool.autoscale();
+        }
+        pool.join();
+        if (cacheStatus) {
+            cacheStatus->finish();
+        }
+        if (constituents) {
+            constituents->finish();
+        }
+        // Before the remaining aggregates are written
+        output.finish();
+
         auto state(state_.lock());
 
         if (state->exc) {
             std::rethrow_exception(state->exc);
         }
 
-        if (myArgs.constituents) {
-            handleConstituents(state->jobs, myArgs);
+        state->stats.output = output.stats();
+        if (cacheStatus) {
+            state->stats.cacheStatus = cacheStatus->stats();
+        }
+
+        if (history) {
+            history->save(myArgs.historyFile);
+        }
+
+        if (constituents) {
+            handleConstituents(constituents->jobs(),
+                               constituents->derivations(), myArgs);
+            state->stats.constituents = constituents->derivations().stats();
+        }
+
+        if (myArgs.showStats) {
+            std::cerr << state->stats.toJson().dump() << "\n";
         }
     });
 }
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+#include <nix/util/error.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/file-system.hh>
+
+#include "output-writer.hh"
+
+namespace {
+constexpr size_t COPY_BUFFER_SIZE = 64 * 1024;
+} // namespace
+
+OutputWriter::OutputWriter(int fd, Backpressure backpressure, size_t capacity)
+    : fd(fd), backpressure(backpressure),
+      queue([this](std::vector<Chunk> &chunks) -> void { writeChunks(chunks); },
+            capacity,
+            [](const Chunk &chunk) -> size_t {
+                return chunk.spilled ? 0 : chunk.line.size() + 1;
+            }) {}
+
+void OutputWriter::write(std::string_view line) {
+    Chunk chunk{.line = std::string(line)};
+    if (backpressure == Backpressure::Block) {
+        queue.push(std::move(chunk));
+        return;
+    }
+
+    const std::lock_guard lock(spillMutex);
+    if (!spilling && queue.tryPush(chunk)) {
+        return;
+    }
+    spillLine(line);
+    counters.spilledLines++;
+    if (!spilling) {
+        spilling = true;
+        // Weighs nothing, so it does not wait for the full buffer
+        queue.push({.line = {}, .spilled = true});
+    }
+}
+
+void OutputWriter::finish() { queue.finish(); }
+
+auto OutputWriter::stats() -> Stats {
+    const std::lock_guard lock(spillMutex);
+    return counters;
+}
+
+void OutputWriter::writeChunks(std::vector<Chunk> &chunks) {
+    pending.clear();
+    for (const auto &chunk : chunks) {
+        if (!chunk.spilled) {
+            pending += chunk.line;
+            pending += '\n';
+            continue;
+        }
+        nix::writeFull(fd, pending);
+        pending.clear();
+        copySpilled();
+    }
+    nix::writeFull(fd, pending);
+}
+
+void OutputWriter::spillLine(std::string_view line) {
+    if (!spill) {
+        auto [tmpFd, tmpPath] = nix::createTempFile("nix-eval-jobs-output");
+        std::filesystem::remove(tmpPath);
+        spill = std::move(tmpFd);
+    }
+    std::string data(line);
+    data += '\n';
+    nix::writeFull(spill.get(), data);
+    spillEnd += data.size();
+}
+
+void OutputWriter::copySpilled() {
+    std::array<char, COPY_BUFFER_SIZE> chunk{};
+    while (true) {
+        uint64_t start = 0;
+        uint64_t end = 0;
+        {
+            const std::lock_guard lock(spillMutex);
+            if (spillStart == spillEnd) {
+                // Caught up, go back to the buffer
+                spillStart = spillEnd = 0;
+                spilling = false;
+                counters.spills++;
+                if (::ftruncate(spill.get(), 0) != 0 ||
+                    ::lseek(spill.get(), 0, SEEK_SET) != 0) {
+                    throw nix::SysError("truncating spilled output");
+                }
+                return;
+            }
+            start = spillStart;
+            end = spillEnd;
+        }
+
+        while (start < end) {
+            const auto want = static_cast<size_t>(
+                std::min<uint64_t>(chunk.size(), end - start));
+            const auto got = ::pread(spill.get(), chunk.data(), want,
+                                     static_cast<off_t>(start));
+            if (got <= 0) {
+                throw nix::SysError("reading spilled output");
+            }
+            nix::writeFull(fd, std::string_view(chunk.data(),
+                                                static_cast<size_t>(got)));
+            start += static_cast<uint64_t>(got);
+        }
+
+        const std::lock_guard lock(spillMutex);
+        spillStart = end;
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <nix/util/file-descriptor.hh>
+
+#include "background-queue.hh"
+
+/* Writes the jobs to stdout from a thread of its own.
+
+   Collectors append lines to a bounded buffer and go back to their
+   workers. The thread takes everything buffered since its last write and
+   writes it at once, so a slow reader of stdout costs one write per batch
+   of jobs rather than a flush per job under a lock shared by all
+   collectors. When the buffer is full, collectors either wait for the
+   thread (Block), or further lines go to an unlinked temporary file until
+   the thread has caught up (Spill). Lines are written in the order they
+   were added either way. */
+class OutputWriter {
+  public:
+    enum class Backpressure : uint8_t { Block, Spill };
+
+    struct Stats {
+        /* Lines that went to the temporary file */
+        size_t spilledLines = 0;
+        /* Times lines went to the file and the thread caught up with them */
+        size_t spills = 0;
+    };
+
+    static constexpr size_t DEFAULT_CAPACITY = 16 * 1024 * 1024;
+
+    OutputWriter(int fd, Backpressure backpressure,
+                 size_t capacity = DEFAULT_CAPACITY);
+
+    /* Appends `line` and a newline. Rethrows the error that stopped the
+       thread, if any. */
+    void write(std::string_view line);
+
+    /* Writes everything added so far and stops the thread. Rethrows the
+       error that stopped it, if any. */
+    void finish();
+
+    /* Only complete after finish(). Until then, `spills` does not count
+       lines the thread is still catching up with. */
+    [[nodiscard]] auto stats() -> Stats;
+
+  private:
+    /* A line, or the lines spilled from here on */
+    struct Chunk {
+        std::string line;
+        bool spilled = false;
+    };
+
+    int fd;
+    Backpressure backpressure;
+
+    std::mutex spillMutex;
+    /* Lines added while the buffer was full, with Spill. Everything before
+       spillStart has been written. */
+    nix::AutoCloseFD spill;
+    uint64_t spillStart = 0;
+    uint64_t spillEnd = 0;
+    /* From the first spilled line until the thread has caught up. Lines go
+       to the file meanwhile, so they stay in order. */
+    bool spilling = false;
+    Stats counters;
+
+    /* Only touched by the thread */
+    std::string pending;
+
+    /* Last, its thread uses the members above */
+    BackgroundQueue<Chunk> queue;
+
+    void writeChunks(std::vector<Chunk> &chunks);
+    void spillLine(std::string_view line);
+    void copySpilled();
+};
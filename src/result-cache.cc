@@ -0,0 +1,164 @@
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <exception>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <nix/store/globals.hh>
+#include <nix/store/local-fs-store.hh>
+#include <nix/store/sqlite.hh>
+#include <nix/util/error.hh>
+#include <nix/util/file-system.hh>
+#include <nix/util/fmt.hh>
+#include <nix/util/hash.hh>
+#include <nix/util/logging.hh>
+#include <nlohmann/json.hpp>
+
+#include "result-cache.hh"
+#include "json-fields.hh"
+
+namespace {
+/* Bump when the job format changes */
+constexpr std::string_view RESULT_CACHE_VERSION = "1";
+
+constexpr std::string_view SCHEMA = R"sql(
+    create table if not exists Results (
+        context  text not null,
+        attrPath text not null,
+        type     integer not null,
+        status   integer not null,
+        payload  text not null,
+        primary key (context, attrPath)
+    );
+    create table if not exists Contexts (
+        context  text primary key not null,
+        lastUsed integer not null
+    );
+)sql";
+
+/* Contexts whose results are kept, the most recently used ones. Every
+   commit of a flake has a context of its own. */
+constexpr size_t KEPT_CONTEXTS = 8;
+} // namespace
+
+ResultCache::ResultCache(const std::string &path, std::string argsKey,
+                         nix::ref<nix::Store> store, nix::Path gcRootsDir)
+    : argsKey(std::move(argsKey)), evalStore(std::move(store)),
+      gcRootsDir(std::move(gcRootsDir)) {
+    auto state(state_.lock());
+    state->db = nix::SQLite(path);
+    state->db.isCache();
+    state->db.exec(std::string(SCHEMA));
+    state->lookup.create(state->db,
+                         "select type, status, payload from Results where "
+                         "context = ? and attrPath = ?");
+    state->insert.create(
+        state->db, "insert or replace into Results(context, attrPath, type, "
+                   "status, payload) values (?, ?, ?, ?, ?)");
+    state->touch.create(state->db, "insert or replace into Contexts(context, "
+                                   "lastUsed) values (?, ?)");
+}
+
+void ResultCache::setFingerprint(std::string_view fingerprint) {
+    auto state(state_.lock());
+    if (state->fingerprintSet) {
+        return;
+    }
+    state->fingerprintSet = true;
+    if (fingerprint.empty()) {
+        nix::warn("not using --result-cache, the flake is not locked");
+        return;
+    }
+    std::string context(RESULT_CACHE_VERSION);
+    context += '\0';
+    context += fingerprint;
+    context += '\0';
+    context += argsKey;
+    state->context = nix::hashString(nix::HashAlgorithm::SHA256, context)
+                         .to_string(nix::HashFormat::Base16, false);
+
+    // Drop the results of contexts that have not been used for a while
+    nix::SQLiteTxn txn(state->db);
+    const auto now = static_cast<int64_t>(std::time(nullptr));
+    state->touch.use()(state->context)(now).exec();
+    const auto kept =
+        nix::fmt("select context from Contexts order by lastUsed desc "
+                 "limit %d",
+                 KEPT_CONTEXTS);
+    state->db.exec("delete from Results where context not in (" + kept +
+                   ")");
+    state->db.exec("delete from Contexts where context not in (" + kept +
+                   ")");
+    txn.commit();
+}
+
+auto ResultCache::lookup(const std::string &attrPath)
+    -> std::optional<Result> {
+    std::optional<Result> result;
+    {
+        auto state(state_.lock());
+        if (state->context.empty()) {
+            return std::nullopt;
+        }
+        auto query(state->lookup.use()(state->context)(attrPath));
+        if (!query.next()) {
+            return std::nullopt;
+        }
+        result = Result{
+            .type = static_cast<FrameType>(query.getInt(0)),
+            .status = static_cast<uint8_t>(query.getInt(1)),
+            .payload = query.getStr(2),
+        };
+    }
+    if (!revalidate(*result)) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+void ResultCache::store(const std::string &attrPath, const Result &result) {
+    auto state(state_.lock());
+    if (state->context.empty()) {
+        return;
+    }
+    state->insert.use()(state->context)(attrPath)(
+        static_cast<int64_t>(result.type))(static_cast<int64_t>(result.status))(
+        result.payload)
+        .exec();
+}
+
+auto ResultCache::revalidate(const Result &result) -> bool {
+    if (result.type != FrameType::Job || nix::settings.readOnlyMode) {
+        return true;
+    }
+
+    std::string drvPath;
+    try {
+        auto value = JsonFields(result.payload).get("drvPath");
+        drvPath = value.has_value() ? value->get<std::string>() : "";
+    } catch (const std::exception &e) {
+        nix::warn("ignoring invalid --result-cache entry: %s", e.what());
+        return false;
+    }
+    if (drvPath.empty()) {
+        return true;
+    }
+
+    // The derivation may have been garbage collected since the last run
+    auto storePath = evalStore->parseStorePath(drvPath);
+    if (!evalStore->isValidPath(storePath)) {
+        return false;
+    }
+
+    if (!gcRootsDir.empty()) {
+        const nix::Path root =
+            gcRootsDir + "/" + std::string(nix::baseNameOf(drvPath));
+        auto localStore = evalStore.dynamic_pointer_cast<nix::LocalFSStore>();
+        if (localStore && !nix::pathExists(root)) {
+            localStore->addPermRoot(storePath, root);
+        }
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include <nix/store/sqlite.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/ref.hh>
+#include <nix/util/sync.hh>
+
+#include "buffered-io.hh"
+
+/* Worker replies of previous runs, kept in the SQLite database given with
+   --result-cache.
+
+   Entries are keyed by the fingerprint of the locked flake, which covers the
+   lock file and the source tree, by the command line without scheduling
+   options (--apply, --select, --arg, --meta, ...) and by the attribute path.
+   As long as those match, a job or attribute set is emitted from the cache
+   instead of being sent to a worker. Failed jobs are never cached. Only the
+   results of the most recently used fingerprints and command lines are
+   kept. */
+class ResultCache {
+  public:
+    struct Result {
+        /* FrameType::Job or FrameType::Attrs */
+        FrameType type = FrameType::Job;
+        uint8_t status = FrameStatusOk;
+        /* Job: the job as JSON. Attrs: JSON array of attribute names */
+        std::string payload;
+    };
+
+    ResultCache(const std::string &path, std::string argsKey,
+                nix::ref<nix::Store> store, nix::Path gcRootsDir);
+
+    /* Called with the fingerprint reported by every worker. Entries are
+       only looked up and stored once a non-empty fingerprint is known; an
+       unlocked flake has none. */
+    void setFingerprint(std::string_view fingerprint);
+
+    /* Returns std::nullopt on a miss, or if the derivation of a cached job
+       is no longer valid. The derivation of a hit gets a GC root in
+       --gc-roots-dir like an evaluated one. */
+    [[nodiscard]] auto lookup(const std::string &attrPath)
+        -> std::optional<Result>;
+    void store(const std::string &attrPath, const Result &result);
+
+  private:
+    struct State {
+        nix::SQLite db;
+        nix::SQLiteStmt lookup;
+        nix::SQLiteStmt insert;
+        /* Marks a context as used now */
+        nix::SQLiteStmt touch;
+        /* Hash of the fingerprint and the arguments, empty if disabled */
+        std::string context;
+        bool fingerprintSet = false;
+    };
+
+    std::string argsKey;
+    nix::ref<nix::Store> evalStore;
+    nix::Path gcRootsDir;
+    nix::Sync<State> state_;
+
+    [[nodiscard]] auto revalidate(const Result &result) -> bool;
+};
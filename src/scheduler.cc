@@ -0,0 +1,157 @@
+#include <cstddef>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <vector>
+// NOLINTBEGIN(misc-header-include-cycle)
+#include <nix/util/signals.hh>
+// NOLINTEND(misc-header-include-cycle)
+
+#include "scheduler.hh"
+
+JobScheduler::JobScheduler(size_t nrQueues)
+    : queues(nrQueues), retired(nrQueues), sleeping(nrQueues) {
+    // The traversal starts at the (empty) root attribute path
+    queues.front().lock()->push_back(AttrPathTable::ROOT);
+    queued = 1;
+    outstanding = 1;
+}
+
+auto JobScheduler::tryPop(size_t queue) -> std::optional<Job> {
+    auto jobs(queues[queue].lock());
+    if (jobs->empty()) {
+        return std::nullopt;
+    }
+    auto job = jobs->back();
+    jobs->pop_back();
+    queued--;
+    return job;
+}
+
+auto JobScheduler::trySteal(size_t thief) -> std::optional<Job> {
+    for (size_t i = 1; i < queues.size(); i++) {
+        auto jobs(queues[(thief + i) % queues.size()].lock());
+        if (jobs->empty()) {
+            continue;
+        }
+        auto job = jobs->front();
+        jobs->pop_front();
+        queued--;
+        return job;
+    }
+    return std::nullopt;
+}
+
+auto JobScheduler::pop(size_t queue) -> std::optional<Job> {
+    while (true) {
+        nix::checkInterrupt();
+        if (aborted) {
+            return std::nullopt;
+        }
+        if (retired[queue]) {
+            // The other collectors may all be asleep, with nobody left to
+            // wake them for the jobs still on our deque
+            const auto left = queues[queue].lock()->size();
+            wakeIdle(left);
+            return std::nullopt;
+        }
+        if (auto job = tryPop(queue)) {
+            return job;
+        }
+        if (auto job = trySteal(queue)) {
+            return job;
+        }
+
+        std::unique_lock lock(idleMutex);
+        sleepers++;
+        sleeping[queue] = true;
+        // `queued` is re-checked after announcing ourselves as sleeper, so a
+        // concurrent complete() either sees us or we see its jobs.
+        idle.wait(lock, [this, queue]() -> bool {
+            return queued > 0 || outstanding == 0 || aborted || retired[queue];
+        });
+        sleeping[queue] = false;
+        sleepers--;
+        if (outstanding == 0) {
+            return std::nullopt;
+        }
+    }
+}
+
+auto JobScheduler::popMore(size_t queue, size_t max) -> std::vector<Job> {
+    std::vector<Job> batch;
+    auto jobs(queues[queue].lock());
+    while (batch.size() < max && !jobs->empty()) {
+        batch.push_back(jobs->back());
+        jobs->pop_back();
+    }
+    queued -= batch.size();
+    return batch;
+}
+
+void JobScheduler::requeue(size_t queue, std::vector<Job> jobs) {
+    const size_t count = jobs.size();
+    if (count == 0) {
+        return;
+    }
+    {
+        auto queueJobs(queues[queue].lock());
+        for (auto job : std::ranges::reverse_view(jobs)) {
+            queueJobs->push_back(job);
+        }
+    }
+    queued += count;
+    wakeIdle(count);
+}
+
+void JobScheduler::complete(size_t queue, std::vector<Job> children) {
+    const size_t count = children.size();
+    if (count > 0) {
+        outstanding += count;
+        {
+            // Pushed in reverse so that the first child is popped next,
+            // keeping the depth-first, lexicographic order of a single worker.
+            auto jobs(queues[queue].lock());
+            for (auto child : std::ranges::reverse_view(children)) {
+                jobs->push_back(child);
+            }
+        }
+        queued += count;
+    }
+
+    if (--outstanding == 0) {
+        wakeIdle(queues.size());
+    } else if (retired[queue]) {
+        // Our collector exits instead of taking one of the children
+        wakeIdle(count);
+    } else if (count > 1) {
+        // We keep one of the children for ourselves
+        wakeIdle(count - 1);
+    }
+}
+
+void JobScheduler::abort() {
+    aborted = true;
+    wakeIdle(queues.size());
+}
+
+void JobScheduler::retire(size_t queue) {
+    retired[queue] = true;
+    wakeIdle(queues.size());
+}
+
+void JobScheduler::reopen(size_t queue) { retired[queue] = false; }
+
+void JobScheduler::wakeIdle(size_t count) {
+    if (sleepers == 0) {
+        return;
+    }
+    const std::lock_guard lock(idleMutex);
+    if (count >= sleepers) {
+        idle.notify_all();
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            idle.notify_one();
+        }
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <nix/util/sync.hh>
+
+#include "attr-path-table.hh"
+
+/* Distributes attribute paths over the collector threads.
+
+   Every collector owns a deque. Children found while evaluating a job are
+   pushed onto the deque of the collector that evaluated the parent and are
+   popped from the back again, so each collector walks its own subtree
+   depth-first. A collector whose deque runs dry steals from the front of
+   another deque, which holds the shallowest and therefore usually largest
+   unexplored subtrees. */
+class JobScheduler {
+  public:
+    using Job = AttrPathId;
+
+    explicit JobScheduler(size_t nrQueues);
+
+    /* Take the next job for the collector owning `queue`. Blocks while other
+       collectors may still produce work and returns std::nullopt once every
+       job has been completed or the scheduler got aborted. */
+    [[nodiscard]] auto pop(size_t queue) -> std::optional<Job>;
+
+    /* Take up to `max` further jobs from the collector's own deque without
+       blocking or stealing. Used to fill a batch after pop(). */
+    [[nodiscard]] auto popMore(size_t queue, size_t max) -> std::vector<Job>;
+
+    /* Hand back jobs that were popped but not evaluated, e.g. because the
+       worker restarted in the middle of a batch. */
+    void requeue(size_t queue, std::vector<Job> jobs);
+
+    /* Mark a job returned by pop() as done and queue its children on the
+       deque of `queue`. */
+    void complete(size_t queue, std::vector<Job> children);
+
+    /* Wake up all collectors and make pop() return std::nullopt. */
+    void abort();
+
+    /* Make pop() on `queue` return std::nullopt so that its collector exits.
+       Jobs left on its deque, or pushed by the collector finishing its last
+       batch, get stolen by the remaining collectors. */
+    void retire(size_t queue);
+    /* Undo retire() for a new collector taking over `queue`. */
+    void reopen(size_t queue);
+
+    [[nodiscard]] auto queuedJobs() const -> size_t { return queued; }
+    [[nodiscard]] auto idleCollectors() const -> size_t { return sleepers; }
+    /* The collector owning `queue` is waiting for work in pop() */
+    [[nodiscard]] auto isIdle(size_t queue) const -> bool {
+        return sleeping[queue];
+    }
+    /* Every job has been completed, or the scheduler got aborted */
+    [[nodiscard]] auto finished() const -> bool {
+        return outstanding == 0 || aborted;
+    }
+
+  private:
+    std::vector<nix::Sync<std::deque<Job>>> queues;
+    std::vector<std::atomic<bool>> retired;
+    std::vector<std::atomic<bool>> sleeping;
+
+    /* Jobs sitting in one of the deques. */
+    std::atomic<size_t> queued = 0;
+    /* Jobs that are queued or currently being evaluated. Termination is
+       reached when this drops to zero. */
+    std::atomic<size_t> outstanding = 0;
+    std::atomic<size_t> sleepers = 0;
+    std::atomic<bool> aborted = false;
+
+    std::mutex idleMutex;
+    std::condition_variable idle;
+
+    [[nodiscard]] auto tryPop(size_t queue) -> std::optional<Job>;
+    [[nodiscard]] auto trySteal(size_t thief) -> std::optional<Job>;
+    void wakeIdle(size_t count);
+};
@@ -2,6 +2,7 @@
 // IWYU pragma: no_include <bits/types/struct_rusage.h>
 
 #include <nix/expr/eval-error.hh>
+#include <nix/expr/eval-gc.hh>
 #include <nix/util/pos-idx.hh>
 #include <nix/util/terminal.hh>
 #include <nix/expr/attr-path.hh>
@@ -9,8 +10,20 @@
 #include <nix/store/globals.hh>
 #include <nix/cmd/installable-flake.hh>
 #include <nix/expr/value-to-json.hh>
+#include <nix/store/path.hh>
+#include <nix/store/store-api.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/processes.hh>
+#include <nix/util/users.hh>
+#include <nix/store/pathlocks.hh>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <nlohmann/json.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <iostream>
 // NOLINTBEGIN(modernize-deprecated-headers)
@@ -18,12 +31,16 @@
 #include <stdlib.h>
 // NOLINTEND(modernize-deprecated-headers)
 #include <exception>
+#include <memory>
 #include <filesystem>
+#include <functional>
 #include <nix/expr/attr-set.hh>
 #include <nix/cmd/common-eval-args.hh>
 #include <nix/util/error.hh>
 #include <nix/expr/eval.hh>
+#include <nix/expr/eval-cache.hh>
 #include <nix/util/file-system.hh>
+#include <nix/util/hash.hh>
 #include <nix/flake/flakeref.hh>
 #include <nix/flake/flake.hh>
 #include <nix/expr/get-drvs.hh>
@@ -36,11 +53,11 @@
 #include <nix/expr/value.hh>
 #include <nix/expr/value/context.hh>
 #include <nlohmann/json_fwd.hpp>
-#include <numeric>
 #include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -50,6 +67,8 @@
 #include "buffered-io.hh"
 #include "eval-args.hh"
 #include "store.hh"
+#include "attr-path-table.hh"
+#include "zygote.hh"
 
 namespace nix {
 struct Expr;
@@ -75,9 +94,25 @@ auto releaseExprTopLevelValue(nix::EvalState &state, nix::Bindings &autoArgs,
     return vRoot;
 }
 
+/* An --apply or --apply-named function */
+struct ApplyFunction {
+    /* Empty for --apply, whose attributes go into extraValue directly */
+    std::string name;
+    nix::Value *value = nullptr;
+};
+
+/* The traversal root, and with --result-cache or --eval-cache the
+   fingerprint of the locked flake it was evaluated from. The functions to
+   apply to the jobs are evaluated along with it, once per worker. */
+struct RootValue {
+    nix::Value *value = nullptr;
+    std::string fingerprint;
+    std::vector<ApplyFunction> apply;
+};
+
 auto evaluateFlake(const nix::ref<nix::EvalState> &state,
-                   const std::string &releaseExpr,
-                   const nix::flake::LockFlags &lockFlags) -> nix::Value * {
+                   const std::string &releaseExpr, const MyArgs &args)
+    -> RootValue {
     auto [flakeRef, fragment, outputSpec] =
         nix::parseFlakeRefWithFragmentAndExtendedOutputsSpec(
             nix::fetchSettings, releaseExpr,
@@ -85,29 +120,28 @@ auto evaluateFlake(const nix::ref<nix::EvalState> &state,
 
     nix::InstallableFlake flake{{},       state,      std::move(flakeRef),
                                 fragment, outputSpec, {},
-                                {},       lockFlags};
+                                {},       args.lockFlags};
+
+    RootValue root;
+    if (!args.resultCacheFile.empty() || args.evalCache) {
+        auto fingerprint = flake.getLockedFlake()->getFingerprint(
+            state->store, nix::fetchSettings);
+        if (fingerprint) {
+            root.fingerprint =
+                fingerprint->to_string(nix::HashFormat::Base16, false);
+        }
+    }
 
     // If no fragment specified, use callFlake to get the full flake structure
     // (just like :lf in the REPL)
     if (fragment.empty()) {
-        auto *value = state->allocValue();
-        nix::flake::callFlake(*state, *flake.getLockedFlake(), *value);
-        return value;
+        root.value = state->allocValue();
+        nix::flake::callFlake(*state, *flake.getLockedFlake(), *root.value);
+        return root;
     }
     // Fragment specified, use normal evaluation
-    return flake.toValue(*state).first;
-}
-
-auto attrPathJoin(nlohmann::json input) -> std::string {
-    return std::accumulate(
-        input.begin(), input.end(), std::string(),
-        [](const std::string &acc, std::string str) -> std::basic_string<char> {
-            // Escape token if containing dots
-            if (str.find('.') != std::string::npos) {
-                str = "\"" + str + "\"";
-            }
-            return acc.empty() ? str : acc + "." + str;
-        });
+    root.value = flake.toValue(*state).first;
+    return root;
 }
 
 auto extractConstituents(nix::EvalState &state, nix::Value *value,
@@ -183,26 +217,33 @@ auto extractConstituents(nix::EvalState &state, nix::Value *value,
     return Constituents(constituents, namedConstituents, globConstituents);
 }
 
-auto applyExprToValue(nix::EvalState &state, nix::Value *value,
-                      const std::string &applyExpr) -> nlohmann::json {
-    if (applyExpr.empty()) {
-        return nlohmann::json{};
-    }
-
-    auto *expr = state.parseExprFromString(applyExpr, state.rootPath("."));
-
-    nix::Value vApply;
-    nix::Value vRes;
-
-    state.eval(expr, vApply);
-    state.callFunction(vApply, *value, vRes, nix::noPos);
-    state.forceAttrs(vRes, nix::noPos, "apply needs to evaluate to an attrset");
+auto evaluateApplyFunction(nix::EvalState &state, const std::string &expr)
+    -> nix::Value * {
+    auto *value = state.allocValue();
+    state.eval(state.parseExprFromString(expr, state.rootPath(".")), *value);
+    return value;
+}
 
-    nix::NixStringContext context;
-    std::stringstream stream;
-    nix::printValueAsJSON(state, true, vRes, nix::noPos, stream, context);
+auto applyFunctions(nix::EvalState &state, nix::Value *value,
+                    const std::vector<ApplyFunction> &apply)
+    -> nlohmann::json {
+    auto extraValue = nlohmann::json::object();
+    for (const auto &function : apply) {
+        nix::Value vRes;
+        state.callFunction(*function.value, *value, vRes, nix::noPos);
 
-    return nlohmann::json::parse(stream.str());
+        nix::NixStringContext context;
+        if (function.name.empty()) {
+            state.forceAttrs(vRes, nix::noPos,
+                             "apply needs to evaluate to an attrset");
+            extraValue.update(nix::printValueAsJSON(state, true, vRes,
+                                                    nix::noPos, context));
+        } else {
+            extraValue[function.name] =
+                nix::printValueAsJSON(state, true, vRes, nix::noPos, context);
+        }
+    }
+    return extraValue;
 }
 
 auto registerGCRoot(nix::EvalState &state, const Drv &drv, const MyArgs &args)
@@ -250,7 +291,8 @@ auto collectAttrsForRecursion(nix::EvalState &state, nix::Value *value,
 
 auto processDerivation(nix::EvalState &state, nix::Value *value,
                        std::string &attrPathS, const nlohmann::json &path,
-                       MyArgs &args, nlohmann::json &reply) -> void {
+                       MyArgs &args, const std::vector<ApplyFunction> &apply,
+                       nlohmann::json &reply) -> void {
     auto packageInfo = nix::getDerivation(state, *value, false);
     if (!packageInfo) {
         auto attrs = collectAttrsForRecursion(state, value, path, args);
@@ -261,9 +303,9 @@ auto processDerivation(nix::EvalState &state, nix::Value *value,
     // Extract constituents if enabled
     auto maybeConstituents = extractConstituents(state, value, args);
 
-    // Apply expression if provided
-    if (!args.applyExpr.empty()) {
-        reply["extraValue"] = applyExprToValue(state, value, args.applyExpr);
+    // Apply functions if provided
+    if (!apply.empty()) {
+        reply["extraValue"] = applyFunctions(state, value, apply);
     }
 
     // Create derivation info
@@ -275,14 +317,26 @@ auto processDerivation(nix::EvalState &state, nix::Value *value,
 }
 
 auto initializeRootValue(const nix::ref<nix::EvalState> &state,
-                         nix::Bindings &autoArgs, MyArgs &args)
-    -> nix::Value * {
-    nix::Value *vEvaluated =
-        args.flake ? evaluateFlake(state, args.releaseExpr, args.lockFlags)
-                   : releaseExprTopLevelValue(*state, autoArgs, args);
+                         nix::Bindings &autoArgs, MyArgs &args) -> RootValue {
+    RootValue root;
+    if (args.flake) {
+        root = evaluateFlake(state, args.releaseExpr, args);
+    } else {
+        root.value = releaseExprTopLevelValue(*state, autoArgs, args);
+    }
+
+    if (!args.applyExpr.empty()) {
+        root.apply.push_back(
+            {.name = "",
+             .value = evaluateApplyFunction(*state, args.applyExpr)});
+    }
+    for (const auto &[name, expr] : args.applyNamedExprs) {
+        root.apply.push_back(
+            {.name = name, .value = evaluateApplyFunction(*state, expr)});
+    }
 
     if (args.selectExpr.empty()) {
-        return vEvaluated;
+        return root;
     }
 
     // Apply the provided select function
@@ -293,62 +347,277 @@ auto initializeRootValue(const nix::ref<nix::EvalState> &state,
     state->eval(selectExpr, vSelect);
 
     nix::Value *vSelected = state->allocValue();
-    state->callFunction(vSelect, *vEvaluated, *vSelected, nix::noPos);
+    state->callFunction(vSelect, *root.value, *vSelected, nix::noPos);
     state->forceAttrs(
         *vSelected, nix::noPos,
         "'--select' must evaluate to an attrset (the traversal root)");
 
-    return vSelected;
+    root.value = vSelected;
+    return root;
 }
 
-auto shouldRestart(const MyArgs &args) -> bool {
+auto maxRss() -> size_t {
     struct rusage resourceUsage = {}; // NOLINT(misc-include-cleaner)
     getrusage(RUSAGE_SELF, &resourceUsage);
-    const size_t maxrss =
+    return static_cast<size_t>(
         resourceUsage
-            .ru_maxrss; // NOLINT(cppcoreguidelines-pro-type-union-access)
-    static constexpr size_t KB_TO_BYTES = 1024;
-    return maxrss > args.maxMemorySize * KB_TO_BYTES;
+            .ru_maxrss); // NOLINT(cppcoreguidelines-pro-type-union-access)
 }
 
-auto processJobRequest(nix::EvalState &state, LineReader &fromReader,
-                       nix::AutoCloseFD &toParent, nix::Bindings &autoArgs,
-                       nix::Value *vRoot, MyArgs &args) -> bool {
-    /* Wait for the collector to send us a job name. */
-    if (tryWriteLine(toParent.get(), "next") < 0) {
-        return false; // main process died
+constexpr size_t KB_TO_BYTES = 1024;
+
+auto shouldRestart(const MyArgs &args) -> bool {
+    return maxRss() > args.maxMemorySize * KB_TO_BYTES;
+}
+
+/* Close enough to the memory limit that the collector should start our
+   replacement now, so it is ready by the time we restart. */
+auto shouldRespawn(const MyArgs &args) -> bool {
+    static constexpr size_t PERCENT = 100;
+    return args.respawnThreshold < MyArgs::MAX_RESPAWN_THRESHOLD &&
+           maxRss() * PERCENT >
+               args.maxMemorySize * KB_TO_BYTES * args.respawnThreshold;
+}
+
+/* Values of attribute paths as the jobs see them, i.e. with functions
+   called with the --arg arguments and forced. They are kept for the
+   lifetime of the worker, so that siblings share the lookups of their
+   common parents instead of walking from the root for every job. */
+class ValueCache {
+  public:
+    ValueCache(nix::EvalState &state, nix::Bindings &autoArgs,
+               nix::Value *vRoot, AttrPathTable &attrPaths)
+        : state(state), autoArgs(autoArgs), vRoot(vRoot),
+          attrPaths(attrPaths) {}
+
+    /* Same lookup as nix::findAlongAttrPath() followed by
+       autoCallFunction(), except that names are never list indices. */
+    auto get(AttrPathId path) -> nix::Value * {
+        auto cached = values.find(path);
+        if (cached != values.end()) {
+            return cached->second;
+        }
+
+        nix::Value *value = vRoot;
+        if (path != AttrPathTable::ROOT) {
+            auto *parent = get(attrPaths.parent(path));
+            if (parent->type() != nix::nAttrs) {
+                state
+                    .error<nix::TypeError>(
+                        "the expression selected by the selection path '%1%' "
+                        "should be a set but is %2%",
+                        attrPaths.attrName(attrPaths.parent(path)),
+                        nix::showType(*parent))
+                    .debugThrow();
+            }
+            const auto name = attrPaths.name(path);
+            const auto *attr = parent->attrs()->get(state.symbols.create(name));
+            if (attr == nullptr) {
+                throw nix::AttrPathNotFound(
+                    "attribute '%1%' in selection path '%2%' not found", name,
+                    attrPaths.attrName(path));
+            }
+            value = attr->value;
+        }
+
+        auto *result = state.allocValue();
+        state.autoCallFunction(autoArgs, *value, *result);
+        state.forceValue(*result, nix::noPos);
+        values.emplace(path, result);
+        return result;
     }
 
-    auto line = fromReader.readLine();
-    if (line == "exit") {
-        return false;
+  private:
+    nix::EvalState &state;
+    nix::Bindings &autoArgs;
+    nix::Value *vRoot;
+    AttrPathTable &attrPaths;
+    std::unordered_map<
+        AttrPathId, nix::Value *, std::hash<AttrPathId>,
+        std::equal_to<AttrPathId>,
+        nix::traceable_allocator<std::pair<const AttrPathId, nix::Value *>>>
+        values;
+};
+
+/* With --eval-cache, attribute paths are looked up through cursors of an
+   eval cache over the traversal root instead. Whatever a previous run has
+   read through a cursor, like the names of attribute sets and the drvPath
+   of derivations, comes from its SQLite database without evaluation. The
+   database is keyed by the flake fingerprint and the arguments selecting
+   the root, so it does not clash with the one nix keeps for the flake
+   outputs. Nothing is written until the cache is destroyed.
+
+   Nix holds a write transaction on the database for as long as the cache
+   exists, so workers cannot share one. Each worker takes the first slot no
+   other worker holds, and uses the database of that slot. A run with the
+   same number of workers reuses the databases of the previous one, though
+   an attribute is only found in the database of the worker that evaluated
+   it then. The slot is taken with the first job, so that a replacement
+   worker does not hold one before it is needed. */
+class CursorCache {
+  public:
+    CursorCache(nix::EvalState &state, const RootValue &root,
+                const MyArgs &args, AttrPathTable &attrPaths)
+        : state(state), rootValue(root.value), attrPaths(attrPaths),
+          key(root.fingerprint + '\0' + args.releaseExpr + '\0' +
+              args.selectExpr) {}
+
+    /* nullptr if the path is below a function. Cursors do not call
+       functions, so those paths are looked up by value. */
+    auto get(AttrPathId path) -> std::shared_ptr<nix::eval_cache::AttrCursor> {
+        auto cached = cursors.find(path);
+        if (cached != cursors.end()) {
+            return cached->second;
+        }
+        if (!evalCache) {
+            open();
+        }
+
+        std::shared_ptr<nix::eval_cache::AttrCursor> cursor;
+        if (path == AttrPathTable::ROOT) {
+            cursor = evalCache->getRoot().get_ptr();
+        } else {
+            auto parent = get(attrPaths.parent(path));
+            if (!parent) {
+                return nullptr;
+            }
+            const auto name = attrPaths.name(path);
+            cursor = parent->maybeGetAttr(name);
+            if (!cursor && !isFunction(*parent)) {
+                throw nix::AttrPathNotFound(
+                    "attribute '%1%' in selection path '%2%' not found", name,
+                    attrPaths.attrName(path));
+            }
+        }
+        cursors.emplace(path, cursor);
+        return cursor;
     }
 
-    if (!nix::hasPrefix(line, "do ")) {
-        std::cerr << "worker error: received invalid command '" << line
-                  << "'\n";
-        abort();
+    static auto isFunction(nix::eval_cache::AttrCursor &cursor) -> bool {
+        return cursor.forceValue().type() == nix::nFunction;
     }
 
-    auto path = nlohmann::json::parse(line.substr(3));
-    auto attrPathS = attrPathJoin(path);
+  private:
+    nix::EvalState &state;
+    nix::Value *rootValue;
+    AttrPathTable &attrPaths;
+    std::string key;
+    /* Held until the worker exits */
+    nix::AutoCloseFD slotLock;
+    std::optional<nix::Hash> slotKey;
+    std::shared_ptr<nix::eval_cache::EvalCache> evalCache;
+
+    /* Takes the first free slot and opens its database */
+    void open() {
+        const auto dir =
+            std::filesystem::path(nix::getCacheDir()) / "nix-eval-jobs";
+        std::filesystem::create_directories(dir);
+        const auto prefix =
+            nix::hashString(nix::HashAlgorithm::SHA256, key)
+                .to_string(nix::HashFormat::Base16, false);
+        for (size_t slot = 0;; slot++) {
+            auto lock = nix::openLockFile(
+                dir / nix::fmt("eval-cache-%s-%d.lock", prefix, slot), true);
+            if (!nix::lockFile(lock.get(), nix::ltWrite, false)) {
+                continue;
+            }
+            slotLock = std::move(lock);
+            slotKey = nix::hashString(nix::HashAlgorithm::SHA256,
+                                      key + '\0' + std::to_string(slot));
+            evalCache = std::make_shared<nix::eval_cache::EvalCache>(
+                std::cref(*slotKey), state,
+                [vRoot = rootValue]() -> nix::Value * { return vRoot; });
+            return;
+        }
+    }
 
-    /* Evaluate it and send info back to the collector. */
-    nlohmann::json reply =
-        nlohmann::json{{"attr", attrPathS}, {"attrPath", path}};
+    /* Destroyed first, cursors keep the eval cache alive */
+    std::unordered_map<AttrPathId,
+                       std::shared_ptr<nix::eval_cache::AttrCursor>>
+        cursors;
+};
+
+/* Like processDerivation() for a cursor. --meta, --constituents and --apply
+   need the value of the derivation, which is evaluated then. Returns false
+   for a function, which is left to ValueCache to call. */
+auto processCursor(nix::EvalState &state, nix::eval_cache::AttrCursor &cursor,
+                   std::string &attrPathS, const nlohmann::json &path,
+                   MyArgs &args, const std::vector<ApplyFunction> &apply,
+                   nlohmann::json &reply) -> bool {
+    if (cursor.isDerivation()) {
+        if (args.meta || args.constituents || !apply.empty()) {
+            processDerivation(state, &cursor.forceValue(), attrPathS, path,
+                              args, apply, reply);
+            return true;
+        }
+        auto drv = Drv(state, cursor, args);
+        reply.update(drv);
+        registerGCRoot(state, drv, args);
+        return true;
+    }
 
+    std::vector<nix::Symbol> names;
     try {
-        auto *vTmp =
-            nix::findAlongAttrPath(state, attrPathS, autoArgs, *vRoot).first;
+        names = cursor.getAttrs();
+    } catch (nix::TypeError &) {
+        /* isDerivation() has forced the value or found it in the cache, so
+           this only fails for values that are not attribute sets. We
+           ignore everything that cannot be built. */
+        if (CursorCache::isFunction(cursor)) {
+            return false;
+        }
+        reply["attrs"] = nlohmann::json::array();
+        return true;
+    }
 
-        auto *value = state.allocValue();
-        state.autoCallFunction(autoArgs, *vTmp, *value);
+    auto attrs = nlohmann::json::array();
+    bool recurse =
+        args.forceRecurse ||
+        path.empty(); // Don't require recurseForDerivations for top-level
+    for (const auto name : names) {
+        const std::string_view nameS = state.symbols[name];
+        attrs.push_back(nameS);
 
-        if (value->type() == nix::nAttrs) {
-            processDerivation(state, value, attrPathS, path, args, reply);
-        } else {
-            // We ignore everything that cannot be built
-            reply["attrs"] = nlohmann::json::array();
+        if (!args.forceRecurse && nameS == "recurseForDerivations") {
+            recurse = cursor.getAttr(name)->getBool();
+        }
+    }
+    reply["attrs"] = recurse ? attrs : nlohmann::json::array();
+    return true;
+}
+
+auto evaluateJob(nix::EvalState &state, ValueCache &values,
+                 CursorCache *cursors, AttrPathTable &attrPaths,
+                 const RootValue &root, MyArgs &args,
+                 const nlohmann::json &path) -> nlohmann::json {
+    const auto attrPath = attrPaths.intern(path);
+    auto attrPathS = attrPaths.attrName(attrPath);
+
+    nlohmann::json reply =
+        nlohmann::json{{"attr", attrPathS}, {"attrPath", path}};
+
+    try {
+        bool done = false;
+        if (cursors != nullptr) {
+            try {
+                auto cursor = cursors->get(attrPath);
+                done = cursor && processCursor(state, *cursor, attrPathS, path,
+                                               args, root.apply, reply);
+            } catch (nix::eval_cache::CachedEvalError &e) {
+                // Evaluate again for the actual error
+                e.force();
+            }
+        }
+        if (!done) {
+            auto *value = values.get(attrPath);
+
+            if (value->type() == nix::nAttrs) {
+                processDerivation(state, value, attrPathS, path, args,
+                                  root.apply, reply);
+            } else {
+                // We ignore everything that cannot be built
+                reply["attrs"] = nlohmann::json::array();
+            }
         }
     } catch (nix::EvalError &e) {
         const auto &err = e.info();
@@ -368,16 +637,195 @@ auto processJobRequest(nix::EvalState &state, LineReader &fromReader,
         std::cerr << msg << '\n';
     }
 
-    if (tryWriteLine(toParent.get(), reply.dump()) < 0) {
+    return reply;
+}
+
+auto sendReply(int toParent, FrameHeader header, const nlohmann::json &reply)
+    -> int {
+    auto attrs = reply.find("attrs");
+    if (attrs != reply.end()) {
+        header.type = FrameType::Attrs;
+        header.childCount = static_cast<uint32_t>(attrs->size());
+        std::string names;
+        for (const auto &name : *attrs) {
+            names += name.get<std::string>();
+            names += '\0';
+        }
+        return tryWriteFrame(toParent, header, names);
+    }
+
+    header.type = FrameType::Job;
+    if (reply.contains("error")) {
+        header.status |= FrameStatusFailed;
+    }
+    auto named = reply.find("namedConstituents");
+    if (named != reply.end() && !named->empty()) {
+        header.status |= FrameStatusAggregate;
+    }
+    return tryWriteFrame(toParent, header, reply.dump());
+}
+
+auto processJobRequest(nix::EvalState &state, FrameReader &fromReader,
+                       nix::AutoCloseFD &toParent, ValueCache &values,
+                       CursorCache *cursors, AttrPathTable &attrPaths,
+                       const RootValue &root, MyArgs &args) -> bool {
+    /* Wait for the collector to send us a job name. */
+    const FrameHeader next{.type = FrameType::Next,
+                           .status = shouldRespawn(args) ? FrameStatusRespawn
+                                                         : FrameStatusOk};
+    const uint64_t rss = maxRss();
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    const auto *rssBytes = reinterpret_cast<const char *>(&rss);
+    if (tryWriteFrame(toParent.get(), next,
+                      std::string_view(rssBytes, sizeof(rss))) < 0) {
         return false; // main process died
     }
 
-    /* Check if we should restart due to memory usage */
-    return !shouldRestart(args);
+    auto frame = fromReader.readFrame();
+    if (!frame.has_value() || frame->header.type == FrameType::Exit) {
+        return false;
+    }
+
+    if (frame->header.type != FrameType::Do) {
+        std::cerr << "worker error: received invalid frame type "
+                  << static_cast<int>(frame->header.type) << "\n";
+        abort();
+    }
+
+    /* Replies are sent one per path, in order, tagged with the position in
+       the batch. If we run out of memory in the middle of a batch we stop
+       early; the collector reads our Restart in place of the next reply and
+       requeues the paths we did not get to. */
+    auto paths = nlohmann::json::parse(frame->payload);
+
+    for (uint32_t i = 0; i < paths.size(); i++) {
+        /* Evaluate it and send info back to the collector. */
+        const auto start = std::chrono::steady_clock::now();
+        const auto rssBefore = maxRss();
+        auto reply = evaluateJob(state, values, cursors, attrPaths, root, args,
+                                 paths[i]);
+        const auto micros =
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        const FrameHeader header{
+            .attr = i,
+            .evalMicros = static_cast<uint32_t>(
+                std::min<int64_t>(micros, UINT32_MAX)),
+            .rssDeltaKiB = static_cast<uint32_t>(
+                std::min<size_t>(maxRss() - rssBefore, UINT32_MAX)),
+        };
+        if (sendReply(toParent.get(), header, reply) < 0) {
+            return false; // main process died
+        }
+
+        /* Check if we should restart due to memory usage */
+        if (shouldRestart(args)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* The zygote forks workers with whatever the root evaluation left open,
+   including the connections to the nix daemon. Sharing such a socket
+   between processes interleaves their requests, so point inherited sockets
+   at /dev/null, then drop the connections from the pool of the store: a
+   request on a detached connection fails and the connection is discarded,
+   after which the pool opens a fresh one. Every pooled connection owns one
+   of the sockets, so a request succeeds after at most that many failures;
+   a store that still fails is not usable from this worker. */
+void detachInheritedSockets(nix::Store &store) {
+    const nix::AutoCloseFD devNull(open("/dev/null", O_RDWR | O_CLOEXEC));
+    if (!devNull) {
+        throw nix::SysError("opening /dev/null");
+    }
+    std::vector<int> sockets;
+    for (const auto &entry :
+         std::filesystem::directory_iterator("/proc/self/fd")) {
+        const int fd = std::stoi(entry.path().filename().string());
+        struct stat st = {};
+        if (fd > 2 && fd != devNull.get() && fstat(fd, &st) == 0 &&
+            S_ISSOCK(st.st_mode)) {
+            sockets.push_back(fd);
+        }
+    }
+    for (const int fd : sockets) {
+        if (dup2(devNull.get(), fd) == -1) {
+            throw nix::SysError("detaching inherited socket %d", fd);
+        }
+    }
+    if (sockets.empty()) {
+        return;
+    }
+
+    const nix::StorePath probe(
+        "00000000000000000000000000000000-nix-eval-jobs-probe");
+    for (size_t failures = 0;; failures++) {
+        try {
+            (void)store.isValidPath(probe);
+            return;
+        } catch (const nix::Error &e) {
+            if (failures == sockets.size()) {
+                throw nix::Error("cannot reconnect to the store after "
+                                 "forking the worker: %s",
+                                 e.msg());
+            }
+        }
+    }
+}
+
+void serveJobs(nix::EvalState &state, nix::Bindings &autoArgs,
+               const RootValue &root, MyArgs &args,
+               nix::AutoCloseFD &toParent, nix::AutoCloseFD &fromParent) {
+    FrameReader fromReader(fromParent.release());
+    AttrPathTable attrPaths;
+    ValueCache values(state, autoArgs, root.value, attrPaths);
+
+    if (!args.resultCacheFile.empty() &&
+        tryWriteFrame(toParent.get(), {.type = FrameType::Fingerprint},
+                      root.fingerprint) < 0) {
+        return; // main process died
+    }
+
+    /* Opened after fork(), the database connection must not be shared.
+       Cursors do not call functions, see CursorCache::get(). With --arg,
+       which the database is not keyed by, everything is looked up by
+       value. */
+    std::unique_ptr<CursorCache> cursors;
+    if (args.evalCache && !root.fingerprint.empty() && autoArgs.empty()) {
+        cursors = std::make_unique<CursorCache>(state, root, args, attrPaths);
+    }
+
+    while (processJobRequest(state, fromReader, toParent, values,
+                             cursors.get(), attrPaths, root, args)) {
+        // Continue processing jobs until we need to exit
+    }
+
+    // Commit the eval cache, we get killed once the collector reads Restart
+    cursors.reset();
+
+    if (tryWriteFrame(toParent.get(), {.type = FrameType::Restart}) < 0) {
+        return; // main process died
+    };
 }
 
 } // namespace
 
+void reportWorkerError(int toParent, const nix::Error &error) {
+    nlohmann::json err;
+    const auto &msg = error.msg();
+    err["error"] = nix::filterANSIEscapes(msg, true);
+    // Don't forget to print it into the STDERR log, this is what's shown in
+    // the Hydra UI.
+    nix::logger->log(nix::lvlError, msg);
+    if (tryWriteFrame(toParent, {.type = FrameType::Error}, err.dump()) < 0) {
+        return; // main process died
+    }
+    (void)tryWriteFrame(toParent, {.type = FrameType::Restart});
+}
+
 void worker(
     MyArgs &args,
     nix::AutoCloseFD &toParent, // NOLINT(bugprone-easily-swappable-parameters)
@@ -388,16 +836,74 @@ void worker(
         args.lookupPath, evalStore, nix::fetchSettings, nix::evalSettings);
     nix::Bindings &autoArgs = *args.getAutoArgs(*state);
 
-    nix::Value *vRoot = initializeRootValue(state, autoArgs, args);
+    auto root = initializeRootValue(state, autoArgs, args);
+
+    serveJobs(*state, autoArgs, root, args, toParent, fromParent);
+}
 
-    LineReader fromReader(fromParent.release());
+void runZygote(MyArgs &args, nix::AutoCloseFD &control) {
+    std::shared_ptr<nix::EvalState> state;
+    nix::Bindings *autoArgs = nullptr;
+    RootValue root;
+    /* Reported by every worker, like a worker failing to start would */
+    std::exception_ptr initError;
 
-    while (processJobRequest(*state, fromReader, toParent, autoArgs, vRoot,
-                             args)) {
-        // Continue processing jobs until we need to exit
+    try {
+        auto evalStore = nix_eval_jobs::openStore(args.evalStoreUrl);
+        auto ref = nix::make_ref<nix::EvalState>(
+            args.lookupPath, evalStore, nix::fetchSettings, nix::evalSettings);
+        autoArgs = args.getAutoArgs(*ref);
+        root = initializeRootValue(ref, *autoArgs, args);
+        state = ref.get_ptr();
+    } catch (nix::Error &) {
+        initError = std::current_exception();
     }
 
-    if (tryWriteLine(toParent.get(), "restart") < 0) {
-        return; // main process died
-    };
+    while (true) {
+        auto fds = receiveFds(control.get(), 2);
+        if (fds.empty()) {
+            return; // main process is done
+        }
+
+        /* Fork twice so that the worker is reparented to the main process
+           (the subreaper) rather than becoming our child. The intermediate
+           process reports the pid of the worker. */
+        nix::Pipe pidPipe;
+        pidPipe.create();
+        nix::Pid intermediate(nix::startProcess(
+            [&]() -> void {
+                pidPipe.readSide.close();
+                const pid_t workerPid = nix::startProcess(
+                    [&]() -> void {
+                        pidPipe.writeSide.close();
+                        control.close();
+                        try {
+                            if (initError) {
+                                std::rethrow_exception(initError);
+                            }
+                            detachInheritedSockets(*state->store);
+                            serveJobs(*state, *autoArgs, root, args, fds[0],
+                                      fds[1]);
+                        } catch (nix::Error &e) {
+                            reportWorkerError(fds[0].get(), e);
+                        }
+                    },
+                    nix::ProcessOptions{.dieWithParent = false,
+                                        .allowVfork = false});
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+                const auto *bytes = reinterpret_cast<const char *>(&workerPid);
+                nix::writeFull(pidPipe.writeSide.get(),
+                               std::string_view(bytes, sizeof(workerPid)));
+            },
+            nix::ProcessOptions{.allowVfork = false}));
+        pidPipe.writeSide.close();
+        fds.clear();
+
+        auto reply = nix::drainFD(pidPipe.readSide.get());
+        intermediate.wait();
+        if (reply.size() != sizeof(pid_t)) {
+            throw nix::Error("zygote failed to fork a worker");
+        }
+        nix::writeFull(control.get(), reply);
+    }
 }
@@ -7,9 +7,16 @@ class MyArgs;
 namespace nix {
 class AutoCloseFD;
 class Bindings;
+class Error;
 class EvalState;
 template <typename T> class ref;
 } // namespace nix
 
 void worker(MyArgs &args, nix::AutoCloseFD &toParent,
             nix::AutoCloseFD &fromParent);
+
+/* Serves Zygote::spawn requests arriving on `control`, see zygote.hh. */
+void runZygote(MyArgs &args, nix::AutoCloseFD &control);
+
+/* Send a worker startup failure to the collector. */
+void reportWorkerError(int toParent, const nix::Error &error);
@@ -0,0 +1,141 @@
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <nix/util/error.hh>
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/processes.hh>
+#include <nix/util/serialise.hh>
+
+#include "zygote.hh"
+
+namespace {
+// Control buffer for SCM_RIGHTS, aligned as required by CMSG_* macros
+auto controlBuffer(size_t fdCount) -> std::vector<struct cmsghdr> {
+    const size_t bytes = CMSG_SPACE(sizeof(int) * fdCount);
+    return std::vector<struct cmsghdr>(
+        (bytes + sizeof(struct cmsghdr) - 1) / sizeof(struct cmsghdr));
+}
+} // namespace
+
+void becomeChildSubreaper() {
+#ifdef __linux__
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        throw nix::SysError("setting child subreaper");
+    }
+#else
+    throw nix::UsageError("--zygote is only supported on Linux");
+#endif
+}
+
+void sendFds(int socket, std::span<const int> fds) {
+    char data = 0;
+    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+    auto control = controlBuffer(fds.size());
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    while (sendmsg(socket, &msg, 0) == -1) {
+        if (errno != EINTR) {
+            throw nix::SysError("sending file descriptors");
+        }
+    }
+}
+
+auto receiveFds(int socket, size_t count) -> std::vector<nix::AutoCloseFD> {
+    char data = 0;
+    struct iovec iov = {.iov_base = &data, .iov_len = 1};
+    auto control = controlBuffer(count);
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    ssize_t res = 0;
+    do {
+        res = recvmsg(socket, &msg, 0);
+    } while (res == -1 && errno == EINTR);
+    if (res == -1) {
+        throw nix::SysError("receiving file descriptors");
+    }
+    if (res == 0) {
+        return {};
+    }
+
+    std::vector<nix::AutoCloseFD> fds;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        const size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < received; i++) {
+            int fd = -1;
+            std::memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(int)), sizeof(int));
+            fds.emplace_back(fd);
+        }
+    }
+    if (fds.size() != count) {
+        throw nix::Error("expected %d file descriptors, received %d", count,
+                         fds.size());
+    }
+    return fds;
+}
+
+Zygote::Zygote(const std::function<void(nix::AutoCloseFD &control)> &serve) {
+    std::array<int, 2> fds{};
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds.data()) == -1) {
+        throw nix::SysError("creating zygote socket");
+    }
+    nix::AutoCloseFD ours(fds[0]);
+    auto theirs = std::make_shared<nix::AutoCloseFD>(fds[1]);
+
+    pid = nix::startProcess(
+        [&, theirs]() -> void {
+            ours.close();
+            serve(*theirs);
+        },
+        nix::ProcessOptions{.allowVfork = false});
+
+    control = std::move(ours);
+}
+
+auto Zygote::spawn(int toParent, int fromParent) -> pid_t {
+    const std::lock_guard lock(mutex);
+
+    const std::array fds{toParent, fromParent};
+    sendFds(control.get(), fds);
+
+    pid_t workerPid = 0;
+    try {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+        nix::readFull(control.get(), reinterpret_cast<char *>(&workerPid),
+                      sizeof(workerPid));
+    } catch (nix::EndOfFile &) {
+        throw nix::Error("zygote process exited unexpectedly");
+    }
+    return workerPid;
+}
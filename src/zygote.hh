@@ -0,0 +1,51 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <span>
+#include <sys/types.h>
+#include <vector>
+
+#include <nix/util/file-descriptor.hh>
+#include <nix/util/processes.hh>
+
+/* With --zygote, evaluation workers are not forked from the main process
+   but from a zygote process that has already opened the store and evaluated
+   the traversal root (including flake locking and --select). Every worker,
+   including the ones replacing workers that hit --max-memory-size, starts
+   from a copy-on-write copy of that heap.
+
+   Workers are double-forked so that they get reparented to the main process,
+   which is registered as child subreaper. This keeps the waitpid() based
+   error reporting in the collector working. Linux only. */
+class Zygote {
+  public:
+    /* Starts the zygote process, which runs `serve` on its end of the
+       control socket. */
+    explicit Zygote(
+        const std::function<void(nix::AutoCloseFD &control)> &serve);
+    Zygote(const Zygote &) = delete;
+    Zygote(Zygote &&) = delete;
+    auto operator=(const Zygote &) -> Zygote & = delete;
+    auto operator=(Zygote &&) -> Zygote & = delete;
+    ~Zygote() = default;
+
+    /* Fork a worker reading commands from `fromParent` and writing replies
+       to `toParent`. Returns the pid of the worker, which is a child of the
+       calling process. */
+    [[nodiscard]] auto spawn(int toParent, int fromParent) -> pid_t;
+
+  private:
+    std::mutex mutex;
+    nix::AutoCloseFD control;
+    nix::Pid pid;
+};
+
+/* Make the calling process adopt orphaned descendants. */
+void becomeChildSubreaper();
+
+/* Pass file descriptors over a unix socket. */
+void sendFds(int socket, std::span<const int> fds);
+/* Returns an empty vector on EOF. */
+[[nodiscard]] auto receiveFds(int socket, size_t count)
+    -> std::vector<nix::AutoCloseFD>;
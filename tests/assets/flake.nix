@@ -15,11 +15,42 @@
             "echo '${text}' > $out"
           ];
         };
+
+      # An aggregate of the jobs named `constituents`
+      makeAggregate =
+        name: constituents:
+        derivation {
+          inherit name system constituents;
+          builder = "/bin/sh";
+          args = [
+            "-c"
+            "echo done > $out"
+          ];
+          _hydraAggregate = true;
+        };
+
+      # Keeps the evaluator busy for `n` rounds of 100000 additions
+      spin =
+        n:
+        builtins.foldl' (
+          acc: _: builtins.foldl' builtins.add acc (builtins.genList (x: x) 100000)
+        ) 0 (builtins.genList (x: x) n);
+      slowTextDrv = name: n: builtins.seq (spin n) (makeTextDrv name name);
     in
     {
       hydraJobs = import ./ci.nix { inherit system; };
 
       legacyPackages.x86_64-linux = {
+        # A long job, and short ones for the workers started next to it
+        autoscale = {
+          a-long = slowTextDrv "a-long" 500;
+        }
+        // builtins.listToAttrs (
+          builtins.genList (i: {
+            name = "short-${toString i}";
+            value = slowTextDrv "short-${toString i}" 10;
+          }) 16
+        );
         emptyNeeded = rec {
           # This is a reproducer for issue #369 where neededBuilds and neededSubstitutes are empty
           # when they should contain values
@@ -126,6 +157,116 @@
           };
           doesnteval = makeTextDrv "constituent" (toString { });
         };
+        streaming = {
+          a_aggregate = makeAggregate "a_aggregate" [ "b_job" ];
+          b_job = makeTextDrv "b_job" "text";
+          c_indirect_aggregate = makeAggregate "c_indirect_aggregate" [ "a_aggregate" ];
+        };
+        # For a binary cache written by the test, with the output of `fixed` and
+        # the out output of `multi`
+        cacheStatus =
+          let
+            fixed = derivation {
+              name = "fixed-input";
+              inherit system;
+              builder = "/bin/sh";
+              outputHashMode = "flat";
+              outputHashAlgo = "sha256";
+              # sha256 of "fixed\n"
+              outputHash = "0c3071418e6356e614898c84ed064ca95e88551bc0811b534bdf1952ecdae534";
+            };
+            user =
+              name:
+              derivation {
+                inherit name system;
+                builder = "/bin/sh";
+                args = [
+                  "-c"
+                  "cat ${fixed} > $out"
+                ];
+              };
+            multi = derivation {
+              name = "multi";
+              inherit system;
+              builder = "/bin/sh";
+              outputs = [
+                "out"
+                "dev"
+              ];
+              args = [
+                "-c"
+                "echo out > $out; echo dev > $dev"
+              ];
+            };
+            devUser = derivation {
+              name = "dev-user";
+              inherit system;
+              builder = "/bin/sh";
+              args = [
+                "-c"
+                "cat ${multi.dev} > $out"
+              ];
+            };
+          in
+          {
+            inherit fixed multi;
+            a = user "a";
+            b = user "b";
+            # Builds `multi` for its dev output, and substitutes its out output
+            split = derivation {
+              name = "split";
+              inherit system;
+              builder = "/bin/sh";
+              args = [
+                "-c"
+                "cat ${multi.out} ${devUser} > $out"
+              ];
+            };
+          };
+        # Functions whose arguments all have defaults are called
+        functions = {
+          withDefaults =
+            {
+              text ? "text",
+            }:
+            makeTextDrv "with-defaults" text;
+          nested =
+            { }:
+            {
+              recurseForDerivations = true;
+              job = makeTextDrv "nested-job" "text";
+            };
+        };
+        # Evaluated in order of their names without a history, cheapest first
+        history = {
+          a-short = slowTextDrv "a-short" 1;
+          b-medium = slowTextDrv "b-medium" 20;
+          c-long = slowTextDrv "c-long" 60;
+        };
+        # Evaluating longDescription fails, so only the other fields may be read
+        metaFields = {
+          job = makeTextDrv "job" "text" // {
+            meta = {
+              description = "A job";
+              license = {
+                spdxId = "MIT";
+              };
+              longDescription = throw "longDescription must not be evaluated";
+            };
+          };
+        };
+        # Two aggregates in a cycle, next to aggregates depending on it or not
+        partialCycle = {
+          cycle0 = makeAggregate "cycle0" [ "cycle1" ];
+          cycle1 = makeAggregate "cycle1" [ "cycle0" ];
+          dependent = makeAggregate "dependent" [
+            "cycle0"
+            "package"
+          ];
+          indirect = makeAggregate "indirect" [ "dependent" ];
+          independent = makeAggregate "independent" [ "package" ];
+          package = makeTextDrv "package" "text";
+        };
         glob1 = {
           constituentA = derivation {
             name = "constituentA";
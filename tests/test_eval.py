@@ -1,12 +1,19 @@
 #!/usr/bin/env python3
 
+import hashlib
 import json
 import os
+import shutil
+import sqlite3
 import subprocess
+import sys
+from contextlib import closing
 from pathlib import Path
 from tempfile import TemporaryDirectory
 from typing import Any
 
+import pytest
+
 TEST_ROOT = Path(__file__).parent.resolve()
 PROJECT_ROOT = TEST_ROOT.parent
 # Allow overriding the binary path with environment variable
@@ -63,6 +70,33 @@ def common_test(extra_args: list[str]) -> list[dict[str, Any]]:
         return results
 
 
+def common_test_unordered(extra_args: list[str]) -> tuple[list[dict[str, Any]], str]:
+    """
+    Like common_test, for runs that do not emit jobs in a fixed order.
+    Returns the jobs and stderr.
+    """
+    with TemporaryDirectory() as tempdir:
+        cmd = [str(BIN), "--gc-roots-dir", tempdir, "--meta", *COMMON_FLAGS, *extra_args]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+
+        results = [json.loads(r) for r in res.stdout.split("\n") if r]
+        assert sorted(r["attr"] for r in results) == [
+            '"dotted.attr"',
+            "builtJob",
+            "package-with-deps",
+            "recurse.drvB",
+        ]
+        assert len(list(Path(tempdir).iterdir())) == 4
+        return results, res.stderr
+
+
 def test_flake() -> None:
     results = common_test(["--flake", ".#hydraJobs"])
     for result in results:
@@ -73,6 +107,306 @@ def test_flake() -> None:
         assert "requiredSystemFeatures" in result
 
 
+def test_batched_protocol() -> None:
+    results = common_test(["--flake", ".#hydraJobs", "--max-batch-size", "8"])
+    assert all("error" not in r for r in results)
+
+
+def test_batched_protocol_restart() -> None:
+    # A zero memory limit restarts the worker after every attribute, so the
+    # rest of each batch has to be handed back to the scheduler.
+    results = common_test(
+        ["--flake", ".#hydraJobs", "--max-batch-size", "8", "--max-memory-size", "0"]
+    )
+    assert all("error" not in r for r in results)
+
+
+@pytest.mark.skipif(sys.platform != "linux", reason="--zygote is Linux only")
+def test_zygote() -> None:
+    # Every worker restart forks a fresh copy of the zygote
+    results = common_test(["--flake", ".#hydraJobs", "--zygote", "--max-memory-size", "0"])
+    assert all("error" not in r for r in results)
+
+
+def test_overlapped_respawn() -> None:
+    # With a zero memory limit every worker is past --respawn-threshold right
+    # away, so each restart switches to a replacement that was started early.
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            *COMMON_FLAGS,
+            "--flake",
+            ".#hydraJobs",
+            "--max-memory-size",
+            "0",
+            "--show-stats",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+
+    results = [json.loads(r) for r in res.stdout.split("\n") if r]
+    assert len(results) == 4
+    assert all("error" not in r for r in results)
+
+    stats = json.loads(res.stderr.strip().splitlines()[-1])
+    assert stats["workers"]["restarts"] > 0
+    assert stats["workers"]["overlappedRestarts"] > 0
+    # Every restart loses the parents forced by the previous worker
+    assert stats["affinity"]["duplicatedParentEvaluations"] > 0
+
+
+def test_affinity_stats() -> None:
+    # A single worker that never restarts evaluates every parent only once
+    _, stderr = common_test_unordered(["--flake", ".#hydraJobs", "--show-stats"])
+    stats = json.loads(stderr.strip().splitlines()[-1])
+    assert stats["affinity"]["jobs"] > 4
+    assert stats["affinity"]["remoteJobs"] == 0
+    assert stats["affinity"]["duplicatedParentEvaluations"] == 0
+
+
+def test_autoscaling() -> None:
+    # Output order depends on how many workers were running
+    results, stderr = common_test_unordered(
+        [
+            "--flake",
+            ".#hydraJobs",
+            "--min-workers",
+            "1",
+            "--max-workers",
+            "4",
+            "--show-stats",
+        ]
+    )
+    assert all("error" not in r for r in results)
+
+    stats = json.loads(stderr.strip().splitlines()[-1])
+    assert 1 <= stats["workers"]["peak"] <= 4
+
+
+def test_autoscaling_retire() -> None:
+    # Workers may be started for the short jobs and retired once they sit
+    # idle while the long one is still being evaluated. How many depends on
+    # timing, see tests/unit/test-scheduler.cc for retiring collectors.
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.autoscale",
+            "--min-workers",
+            "1",
+            "--max-workers",
+            "4",
+            "--show-stats",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+            timeout=300,
+        )
+
+    results = [json.loads(r) for r in res.stdout.split("\n") if r]
+    assert len(results) == 17
+    assert all("error" not in r for r in results)
+
+    stats = json.loads(res.stderr.strip().splitlines()[-1])
+    assert 1 <= stats["workers"]["peak"] <= 4
+    assert stats["workers"]["started"] >= 0
+
+
+def test_history_file() -> None:
+    with TemporaryDirectory() as tempdir:
+        history_file = Path(tempdir) / "history.json"
+        for _ in range(2):
+            # Ordering changes with the history
+            results, _ = common_test_unordered(
+                ["--flake", ".#hydraJobs", "--history-file", str(history_file)]
+            )
+            assert all("error" not in r for r in results)
+
+            history = json.loads(history_file.read_text())
+            assert history["version"] == 1
+            attrs = {tuple(a["attrPath"]): a for a in history["attrs"]}
+            assert ("builtJob",) in attrs
+            assert ("recurse",) in attrs
+            assert attrs[("recurse",)]["children"] > 0
+            assert all(a["seconds"] >= 0 for a in attrs.values())
+
+
+def test_history_file_order() -> None:
+    with TemporaryDirectory() as tempdir:
+        history_file = Path(tempdir) / "history.json"
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--workers",
+            "1",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.history",
+            "--history-file",
+            str(history_file),
+        ]
+
+        def evaluate() -> list[str]:
+            res = subprocess.run(
+                cmd,
+                cwd=TEST_ROOT.joinpath("assets"),
+                text=True,
+                check=True,
+                stdout=subprocess.PIPE,
+            )
+            return [json.loads(r)["attr"] for r in res.stdout.splitlines()]
+
+        assert evaluate() == ["a-short", "b-medium", "c-long"]
+        # The longest job is scheduled first once it is in the history
+        order = evaluate()
+        assert order[0] == "c-long"
+        assert sorted(order) == ["a-short", "b-medium", "c-long"]
+
+
+def test_result_cache() -> None:
+    with TemporaryDirectory() as tempdir:
+        # A copy outside of the git checkout, so the flake is always locked
+        flake = Path(tempdir) / "assets"
+        shutil.copytree(TEST_ROOT.joinpath("assets"), flake)
+        cache = Path(tempdir) / "results.sqlite"
+        args = ["--flake", f"path:{flake}#hydraJobs", "--result-cache", str(cache), "--show-stats"]
+
+        first, stderr = common_test_unordered(args)
+        stats = json.loads(stderr.strip().splitlines()[-1])["resultCache"]
+        assert stats["hits"] == 0
+        assert stats["misses"] > 0
+
+        second, stderr = common_test_unordered(args)
+        stats = json.loads(stderr.strip().splitlines()[-1])["resultCache"]
+        assert stats["hits"] > 0
+        assert stats["misses"] == 0
+        assert sorted(first, key=lambda r: r["attr"]) == sorted(second, key=lambda r: r["attr"])
+
+        # Results of other flake revisions or command lines, and some left by
+        # a version that did not record contexts
+        with closing(sqlite3.connect(cache)) as db, db:
+            for i in range(8):
+                db.execute("insert into Contexts values (?, ?)", (f"stale-{i}", i))
+            for context in [*(f"stale-{i}" for i in range(8)), "orphan"]:
+                db.execute(
+                    "insert into Results values (?, 'job', 0, 0, '{}')",
+                    (context,),
+                )
+
+        _, stderr = common_test_unordered(args)
+        stats = json.loads(stderr.strip().splitlines()[-1])["resultCache"]
+        assert stats["misses"] == 0
+        # Only the most recently used contexts are kept
+        with closing(sqlite3.connect(cache)) as db:
+            contexts = {c for (c,) in db.execute("select context from Contexts")}
+            results = {c for (c,) in db.execute("select distinct context from Results")}
+        assert len(contexts) == 8
+        assert "stale-0" not in contexts
+        assert results == contexts
+
+
+def test_eval_cache(monkeypatch: pytest.MonkeyPatch) -> None:
+    with TemporaryDirectory() as tempdir:
+        monkeypatch.setenv("XDG_CACHE_HOME", tempdir)
+        # A copy outside of the git checkout, so the flake is always locked
+        flake = Path(tempdir) / "assets"
+        shutil.copytree(TEST_ROOT.joinpath("assets"), flake)
+
+        def evaluate(*extra_args: str) -> list[dict[str, Any]]:
+            res = subprocess.run(
+                [str(BIN), *COMMON_FLAGS, "--flake", f"path:{flake}#hydraJobs", *extra_args],
+                text=True,
+                check=True,
+                stdout=subprocess.PIPE,
+            )
+            return [json.loads(r) for r in res.stdout.split("\n") if r]
+
+        expected = evaluate()
+        assert len(expected) == 4
+        assert evaluate("--eval-cache") == expected
+        assert list(Path(tempdir).glob("nix/eval-cache-v*/*.sqlite"))
+        # Served from the eval cache
+        assert evaluate("--eval-cache") == expected
+
+
+def test_eval_cache_functions(monkeypatch: pytest.MonkeyPatch) -> None:
+    with TemporaryDirectory() as tempdir:
+        monkeypatch.setenv("XDG_CACHE_HOME", tempdir)
+        flake = Path(tempdir) / "assets"
+        shutil.copytree(TEST_ROOT.joinpath("assets"), flake)
+
+        def evaluate(*extra_args: str) -> list[dict[str, Any]]:
+            res = subprocess.run(
+                [
+                    str(BIN),
+                    *COMMON_FLAGS,
+                    "--flake",
+                    f"path:{flake}#legacyPackages.x86_64-linux.functions",
+                    *extra_args,
+                ],
+                text=True,
+                check=True,
+                stdout=subprocess.PIPE,
+            )
+            results = [json.loads(r) for r in res.stdout.split("\n") if r]
+            return sorted(results, key=lambda r: r["attr"])
+
+        expected = evaluate()
+        assert [r["attr"] for r in expected] == ["nested.job", "withDefaults"]
+        # Looked up by value, which calls them, rather than through cursors
+        for _ in range(2):
+            assert evaluate("--eval-cache") == expected
+
+
+def test_eval_cache_workers(monkeypatch: pytest.MonkeyPatch) -> None:
+    with TemporaryDirectory() as tempdir:
+        monkeypatch.setenv("XDG_CACHE_HOME", tempdir)
+        flake = Path(tempdir) / "assets"
+        shutil.copytree(TEST_ROOT.joinpath("assets"), flake)
+
+        def evaluate(*extra_args: str) -> list[dict[str, Any]]:
+            res = subprocess.run(
+                [
+                    str(BIN),
+                    *COMMON_FLAGS,
+                    "--flake",
+                    f"path:{flake}#hydraJobs",
+                    "--workers",
+                    "2",
+                    *extra_args,
+                ],
+                text=True,
+                check=True,
+                stdout=subprocess.PIPE,
+                timeout=120,
+            )
+            results = [json.loads(r) for r in res.stdout.split("\n") if r]
+            return sorted(results, key=lambda r: r["attr"])
+
+        expected = evaluate()
+        # Workers use databases of their own rather than waiting for each other
+        for _ in range(2):
+            assert evaluate("--eval-cache") == expected
+        assert list(Path(tempdir).glob("nix/nix-eval-jobs/eval-cache-*-0.lock"))
+
+
 def test_query_cache_status() -> None:
     results = common_test(["--flake", ".#hydraJobs", "--check-cache-status"])
     # FIXME in the nix sandbox we cannot query binary caches
@@ -82,6 +416,87 @@ def test_query_cache_status() -> None:
         assert "cacheStatus" in result
         assert "neededBuilds" in result
         assert "neededSubstitutes" in result
+    # Jobs are resolved in batches, but each only lists what it needs itself
+    drv_paths = {result["drvPath"] for result in results}
+    for result in results:
+        others = drv_paths - {result["drvPath"]}
+        assert not others.intersection(result["neededBuilds"])
+
+
+def nar_of_file(content: bytes) -> bytes:
+    """
+    NAR serialisation of a regular file
+    """
+
+    def field(data: bytes) -> bytes:
+        return len(data).to_bytes(8, "little") + data + b"\0" * (-len(data) % 8)
+
+    strings = [b"nix-archive-1", b"(", b"type", b"regular", b"contents", content, b")"]
+    return b"".join(field(s) for s in strings)
+
+
+def test_cache_status_binary_cache() -> None:
+    with TemporaryDirectory() as tempdir:
+
+        def evaluate(*extra_args: str) -> tuple[dict[str, Any], dict[str, Any]]:
+            cmd = [
+                str(BIN),
+                "--gc-roots-dir",
+                tempdir,
+                *COMMON_FLAGS,
+                "--check-cache-status",
+                "--show-stats",
+                *extra_args,
+                "--flake",
+                ".#legacyPackages.x86_64-linux.cacheStatus",
+            ]
+            res = subprocess.run(
+                cmd,
+                cwd=TEST_ROOT.joinpath("assets"),
+                text=True,
+                check=True,
+                stdout=subprocess.PIPE,
+                stderr=subprocess.PIPE,
+            )
+            jobs = {job["attr"]: job for job in map(json.loads, res.stdout.splitlines())}
+            return jobs, json.loads(res.stderr.strip().splitlines()[-1])["cacheStatus"]
+
+        jobs, _ = evaluate()
+        assert jobs["fixed"]["cacheStatus"] == "notBuilt"
+        fixed_out = Path(jobs["fixed"]["outputs"]["out"])
+        multi_out = Path(jobs["multi"]["outputs"]["out"])
+
+        # A file:// binary cache with the output of `fixed` and the out output
+        # of `multi`, written by hand
+        cache = Path(tempdir) / "cache"
+        cache.joinpath("nar").mkdir(parents=True)
+        cache.joinpath("nix-cache-info").write_text(f"StoreDir: {fixed_out.parent}\n")
+        for out_path, content in [(fixed_out, b"fixed\n"), (multi_out, b"out\n")]:
+            nar = nar_of_file(content)
+            cache.joinpath("nar", f"{out_path.name}.nar").write_bytes(nar)
+            cache.joinpath(f"{out_path.name.split('-')[0]}.narinfo").write_text(
+                f"StorePath: {out_path}\n"
+                f"URL: nar/{out_path.name}.nar\n"
+                "Compression: none\n"
+                f"NarHash: sha256:{hashlib.sha256(nar).hexdigest()}\n"
+                f"NarSize: {len(nar)}\n"
+                "References: \n"
+            )
+
+        substituter = ["--option", "substituters", f"file://{cache}"]
+        jobs, stats = evaluate(*substituter, "--option", "require-sigs", "false")
+        assert jobs["fixed"]["cacheStatus"] == "cached"
+        assert jobs["fixed"]["neededSubstitutes"] == [str(fixed_out)]
+        # The shared input is attributed to every job that needs it
+        for name in ["a", "b"]:
+            assert jobs[name]["neededSubstitutes"] == [str(fixed_out)]
+        assert stats["hits"] + stats["misses"] == len(jobs)
+        assert stats["misses"] >= 1
+
+        # `multi` is built for the dev output, which must not hide that the
+        # out output is substituted
+        assert jobs["multi"]["drvPath"] in jobs["split"]["neededBuilds"]
+        assert str(multi_out) in jobs["split"]["neededSubstitutes"]
 
 
 def test_expression() -> None:
@@ -104,6 +519,11 @@ def test_input_drvs() -> None:
         assert "inputDrvs" in result
 
 
+def test_output_backpressure() -> None:
+    for mode in ["block", "spill"]:
+        common_test(["ci.nix", "--output-backpressure", mode])
+
+
 def test_eval_error() -> None:
     with TemporaryDirectory() as tempdir:
         cmd = [
@@ -206,6 +626,64 @@ def test_constituents() -> None:
         check_gc_root(tempdir, mixed["drvPath"])
 
 
+def test_constituents_streaming() -> None:
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--workers",
+            "1",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.streaming",
+            "--constituents",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+        )
+
+        results = [json.loads(r) for r in res.stdout.splitlines()]
+        # Aggregates are written as soon as their constituents are known, but
+        # never before them
+        assert [x["attr"] for x in results] == ["b_job", "a_aggregate", "c_indirect_aggregate"]
+        job, aggregate, indirect = results
+        assert aggregate["constituents"] == [job["drvPath"]]
+        assert indirect["constituents"] == [aggregate["drvPath"]]
+        for result in [aggregate, indirect]:
+            assert "error" not in result
+            check_gc_root(tempdir, result["drvPath"])
+
+
+def test_constituents_stats() -> None:
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--show-stats",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.success",
+            "--constituents",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.PIPE,
+        )
+        # indirect_aggregate and mixed_aggregate share "anotherone"
+        stats = json.loads(res.stderr.strip().splitlines()[-1])
+        assert stats["constituents"] == {"hits": 1, "misses": 1}
+
+
 def test_constituents_all() -> None:
     with TemporaryDirectory() as tempdir:
         cmd = [
@@ -315,6 +793,53 @@ def test_constituents_cycle() -> None:
             assert i["error"] == "Dependency cycle: aggregate0 <-> aggregate1"
 
 
+def test_constituents_partial_cycle() -> None:
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--workers",
+            "1",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.partialCycle",
+            "--constituents",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+        )
+
+        results: dict[str, dict[str, Any]] = {}
+        for line in res.stdout.splitlines():
+            result = json.loads(line)
+            results[result["attr"]] = result
+        assert set(results) == {
+            "cycle0",
+            "cycle1",
+            "dependent",
+            "indirect",
+            "independent",
+            "package",
+        }
+
+        for name in ["cycle0", "cycle1"]:
+            assert results[name]["error"] == "Dependency cycle: cycle0 <-> cycle1"
+        # Aggregates depending on the cycle fail, naming the way they depend on it
+        assert (
+            results["dependent"]["error"] == "cycle0: Dependency cycle: cycle0 <-> cycle1\n"
+        )
+        assert results["indirect"]["error"] == "dependent: depends on a dependency cycle\n"
+
+        assert "error" not in results["independent"]
+        check_gc_root(tempdir, results["independent"]["drvPath"])
+        assert results["independent"]["constituents"] == [results["package"]["drvPath"]]
+
+
 def test_constituents_error() -> None:
     with TemporaryDirectory() as tempdir:
         cmd = [
@@ -392,6 +917,31 @@ def test_empty_needed() -> None:
         assert any(nginx_result["drvPath"] in drv for drv in proxy_wrapper_result["neededBuilds"])
 
 
+def test_meta_fields() -> None:
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--meta-fields",
+            "description,license",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#legacyPackages.x86_64-linux.metaFields",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+        )
+
+        [job] = [json.loads(r) for r in res.stdout.splitlines()]
+        assert "error" not in job
+        assert job["meta"] == {"description": "A job", "license": {"spdxId": "MIT"}}
+
+
 def test_apply() -> None:
     with TemporaryDirectory() as tempdir:
         applyExpr = """drv: {
@@ -436,6 +986,42 @@ def test_apply() -> None:
         assert results[3]["extraValue"]["version"] is None
 
 
+def test_apply_named() -> None:
+    with TemporaryDirectory() as tempdir:
+        cmd = [
+            str(BIN),
+            "--gc-roots-dir",
+            tempdir,
+            "--workers",
+            "1",
+            "--apply",
+            "drv: { the-name = drv.name; }",
+            "--apply-named",
+            "system=drv: drv.system",
+            "--apply-named",
+            "outputs=drv: drv.outputs",
+            *COMMON_FLAGS,
+            "--flake",
+            ".#hydraJobs",
+        ]
+        res = subprocess.run(
+            cmd,
+            cwd=TEST_ROOT.joinpath("assets"),
+            text=True,
+            check=True,
+            stdout=subprocess.PIPE,
+        )
+
+        results = [json.loads(r) for r in res.stdout.split("\n") if r]
+        assert len(results) == 4
+        for result in results:
+            assert result["extraValue"] == {
+                "the-name": result["name"],
+                "system": "x86_64-linux",
+                "outputs": ["out"],
+            }
+
+
 def test_select_flake() -> None:
     """Test the --select option to filter flake outputs before evaluation"""
     with TemporaryDirectory() as tempdir:
@@ -0,0 +1,235 @@
+// OutputWriter against a pipe that is only read when the test says so.
+//
+// For the spill tests, the pipe is filled up before the lines are written, so
+// the writer thread blocks on its first write and the lines after it spill,
+// without depending on how fast anything runs.
+
+#include <array>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+
+#include <nix/util/file-descriptor.hh>
+
+#include "output-writer.hh"
+
+namespace {
+
+constexpr size_t LINES = 5000;
+constexpr size_t MAX_PADDING = 100;
+constexpr size_t READ_SIZE = 4096;
+/* Divides the size of the pipe and is at most PIPE_BUF, so the pipe ends up
+   without room for a single byte */
+constexpr size_t FILLER_SIZE = 512;
+
+[[noreturn]] void fail(std::string_view message) {
+    std::cerr << "FAIL: " << message << "\n";
+    std::exit(1);
+}
+
+void check(bool condition, std::string_view message) {
+    if (!condition) {
+        fail(message);
+    }
+}
+
+auto makeLine(size_t i) -> std::string {
+    return "line-" + std::to_string(i) + " " +
+           std::string(i % MAX_PADDING, 'x');
+}
+
+struct Pipe {
+    nix::AutoCloseFD readSide;
+    nix::AutoCloseFD writeSide;
+
+    Pipe() {
+        std::array<int, 2> fds{};
+        if (::pipe(fds.data()) != 0) {
+            fail("pipe");
+        }
+        readSide = fds[0];
+        writeSide = fds[1];
+    }
+};
+
+class LineReader {
+  public:
+    explicit LineReader(int fd) : fd(fd) {}
+
+    /* Returns false at the end of the input */
+    auto next(std::string &line) -> bool {
+        while (true) {
+            const auto newline = buffer.find('\n', pos);
+            if (newline != std::string::npos) {
+                line = buffer.substr(pos, newline - pos);
+                pos = newline + 1;
+                return true;
+            }
+            buffer.erase(0, pos);
+            pos = 0;
+            std::array<char, READ_SIZE> chunk{};
+            const auto got = ::read(fd, chunk.data(), chunk.size());
+            if (got < 0) {
+                fail("read");
+            }
+            if (got == 0) {
+                check(buffer.empty(), "incomplete last line");
+                return false;
+            }
+            buffer.append(chunk.data(), static_cast<size_t>(got));
+        }
+    }
+
+  private:
+    int fd;
+    std::string buffer;
+    size_t pos = 0;
+};
+
+/* Writes filler lines until the pipe is full, returns how many */
+auto fillPipe(int fd) -> size_t {
+    const int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        fail("fcntl");
+    }
+    const auto filler = std::string(FILLER_SIZE - 1, 'f') + "\n";
+    size_t count = 0;
+    while (::write(fd, filler.data(), filler.size()) ==
+           static_cast<ssize_t>(filler.size())) {
+        count++;
+    }
+    check(errno == EAGAIN, "filling the pipe");
+    if (::fcntl(fd, F_SETFL, flags) != 0) {
+        fail("fcntl");
+    }
+    return count;
+}
+
+void skipFiller(LineReader &reader, size_t count) {
+    std::string line;
+    for (size_t i = 0; i < count; i++) {
+        check(reader.next(line) && line.size() == FILLER_SIZE - 1,
+              "missing filler");
+    }
+}
+
+/* Checks that `count` lines starting at `first` come next */
+void expectLines(LineReader &reader, size_t first, size_t count) {
+    std::string line;
+    for (size_t i = first; i < first + count; i++) {
+        check(reader.next(line), "missing lines");
+        if (line != makeLine(i)) {
+            fail("expected '" + makeLine(i) + "', got '" + line + "'");
+        }
+    }
+}
+
+void testBlock() {
+    Pipe pipe;
+    LineReader reader(pipe.readSide.get());
+    std::thread readerThread([&]() -> void {
+        expectLines(reader, 0, LINES);
+        std::string line;
+        check(!reader.next(line), "unexpected lines");
+    });
+
+    OutputWriter output(pipe.writeSide.get(),
+                        OutputWriter::Backpressure::Block, 1);
+    for (size_t i = 0; i < LINES; i++) {
+        output.write(makeLine(i));
+    }
+    output.finish();
+    pipe.writeSide.close();
+    readerThread.join();
+
+    check(output.stats().spilledLines == 0, "block spilled");
+}
+
+void testSpill() {
+    Pipe pipe;
+    LineReader reader(pipe.readSide.get());
+    OutputWriter output(pipe.writeSide.get(),
+                        OutputWriter::Backpressure::Spill, 1);
+
+    auto filler = fillPipe(pipe.writeSide.get());
+    for (size_t i = 0; i < LINES; i++) {
+        output.write(makeLine(i));
+    }
+    // Besides the line the thread is writing and one in the buffer
+    const auto spilled = output.stats().spilledLines;
+    check(spilled >= LINES - 2, "lines were not spilled");
+
+    // Once everything has been read, the thread has copied the spilled
+    // lines and goes back to the buffer
+    skipFiller(reader, filler);
+    expectLines(reader, 0, LINES);
+    while (output.stats().spills == 0) {
+        std::this_thread::yield();
+    }
+    check(output.stats().spills == 1, "expected one spill");
+
+    filler = fillPipe(pipe.writeSide.get());
+    for (size_t i = LINES; i < 2 * LINES; i++) {
+        output.write(makeLine(i));
+    }
+    check(output.stats().spilledLines >= spilled + LINES - 2,
+          "lines were not spilled again");
+
+    std::thread readerThread([&]() -> void {
+        skipFiller(reader, filler);
+        expectLines(reader, LINES, LINES);
+        std::string line;
+        check(!reader.next(line), "unexpected lines");
+    });
+    output.finish();
+    pipe.writeSide.close();
+    readerThread.join();
+
+    check(output.stats().spills == 2, "expected two spills");
+}
+
+void testReaderGone() {
+    Pipe pipe;
+    pipe.readSide.close();
+    OutputWriter output(pipe.writeSide.get(),
+                        OutputWriter::Backpressure::Block, 1);
+
+    // The thread fails on its first write, and a later write rethrows that
+    bool thrown = false;
+    for (size_t i = 0; i < LINES && !thrown; i++) {
+        try {
+            output.write(makeLine(i));
+        } catch (const std::exception &) {
+            thrown = true;
+        }
+    }
+    check(thrown, "write did not throw");
+
+    thrown = false;
+    try {
+        output.finish();
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    check(thrown, "finish did not throw");
+}
+
+} // namespace
+
+auto main() -> int {
+    // Writing to the pipe without a reader fails with EPIPE instead
+    std::signal(SIGPIPE, SIG_IGN);
+
+    testBlock();
+    testSpill();
+    testReaderGone();
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Retiring collectors of the JobScheduler.
+//
+// The collectors are driven step by step from the test, so what is queued
+// and who is asleep is known whenever a collector gets retired. A collector
+// that is never woken up hangs the test until meson's timeout fails it.
+
+#include <cstddef>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <set>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "scheduler.hh"
+
+namespace {
+
+using Job = JobScheduler::Job;
+
+[[noreturn]] void fail(std::string_view message) {
+    std::cerr << "FAIL: " << message << "\n";
+    std::exit(1);
+}
+
+void check(bool condition, std::string_view message) {
+    if (!condition) {
+        fail(message);
+    }
+}
+
+/* Completes every job `queue` gets until the scheduler is done */
+auto drain(JobScheduler &scheduler, size_t queue,
+           const std::function<std::vector<Job>(Job)> &children)
+    -> std::set<Job> {
+    std::set<Job> done;
+    while (auto job = scheduler.pop(queue)) {
+        check(done.insert(*job).second, "job popped twice");
+        scheduler.complete(queue, children(*job));
+    }
+    return done;
+}
+
+auto range(Job first, Job last) -> std::vector<Job> {
+    std::vector<Job> jobs;
+    for (Job job = first; job <= last; job++) {
+        jobs.push_back(job);
+    }
+    return jobs;
+}
+
+/* The jobs left on the deque of a retired collector, and the children of its
+   last batch, go to the others */
+void testRetireWithBatchInFlight() {
+    JobScheduler scheduler(2);
+    check(scheduler.pop(0) == AttrPathTable::ROOT, "expected the root");
+    scheduler.complete(0, range(1, 10));
+
+    const auto first = scheduler.pop(0);
+    check(first == 1, "expected the first child");
+    const auto batch = scheduler.popMore(0, 3);
+    check(batch == range(2, 4), "expected the next children");
+
+    scheduler.retire(0);
+    check(!scheduler.pop(0), "a retired collector got a job");
+
+    scheduler.complete(0, {});
+    scheduler.complete(0, {11, 12});
+    scheduler.complete(0, {});
+    scheduler.complete(0, {});
+
+    const auto done =
+        drain(scheduler, 1, [](Job) -> std::vector<Job> { return {}; });
+    auto expected = range(5, 12);
+    check(done == std::set<Job>(expected.begin(), expected.end()),
+          "jobs of the retired collector got lost");
+    check(scheduler.finished(), "not finished");
+}
+
+/* A sleeping collector is woken up for the children of a retired
+   collector's last job, even if there is only one */
+void testRetireWakesSleepers() {
+    JobScheduler scheduler(2);
+    check(scheduler.pop(0) == AttrPathTable::ROOT, "expected the root");
+    scheduler.retire(0);
+
+    std::set<Job> done;
+    std::thread collector([&]() -> void {
+        done = drain(scheduler, 1, [](Job job) -> std::vector<Job> {
+            return job == 1 ? std::vector<Job>{2, 3} : std::vector<Job>{};
+        });
+    });
+    while (!scheduler.isIdle(1)) {
+        std::this_thread::yield();
+    }
+
+    // Only complete() can wake it: it fell asleep after retire(), and the
+    // jobs left behind by pop(0) are handed over after the join
+    scheduler.complete(0, {1});
+    collector.join();
+    check(!scheduler.pop(0), "a retired collector got a job");
+
+    check(done == std::set<Job>{1, 2, 3}, "unexpected jobs");
+    check(scheduler.finished(), "not finished");
+}
+
+/* A new collector taking over a retired queue gets its jobs again */
+void testReopen() {
+    JobScheduler scheduler(1);
+    scheduler.retire(0);
+    check(!scheduler.pop(0), "a retired collector got a job");
+
+    scheduler.reopen(0);
+    const auto done = drain(scheduler, 0, [](Job job) -> std::vector<Job> {
+        return job == AttrPathTable::ROOT ? range(1, 3) : std::vector<Job>{};
+    });
+    check(done == std::set<Job>{AttrPathTable::ROOT, 1, 2, 3},
+          "unexpected jobs");
+    check(scheduler.finished(), "not finished");
+}
+
+} // namespace
+
+auto main() -> int {
+    testRetireWithBatchInFlight();
+    testRetireWakesSleepers();
+    testReopen();
+    return 0;
+}